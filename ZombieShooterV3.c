@@ -1,10 +1,59 @@
+//clock_gettime and the mmap flags are hidden under a strict -std=c99 without this
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "raylib.h"
+#include "rlgl.h"
 #include "math.h"
 #include "stdio.h"
 #include "string.h"
 #include "time.h"
 #include "stdlib.h"
 #include "unistd.h"
+#include "pthread.h"
+#include "sched.h"
+#include "stdatomic.h"
+#include "limits.h"
+
+#if defined(_WIN32)
+//windows.h clashes with raylib (CloseWindow, DrawText, Rectangle), so the kernel32 calls used are declared here
+__declspec(dllimport) int __stdcall QueryPerformanceCounter(long long* count);
+__declspec(dllimport) int __stdcall QueryPerformanceFrequency(long long* frequency);
+
+//Same layout as SYSTEM_INFO
+typedef struct Win32SystemInfo {
+    unsigned short processorArchitecture;
+    unsigned short reserved;
+    unsigned long pageSize;
+    void* minimumApplicationAddress;
+    void* maximumApplicationAddress;
+    size_t activeProcessorMask;
+    unsigned long numberOfProcessors;
+    unsigned long processorType;
+    unsigned long allocationGranularity;
+    unsigned short processorLevel;
+    unsigned short processorRevision;
+} Win32SystemInfo;
+
+__declspec(dllimport) void __stdcall GetSystemInfo(Win32SystemInfo* info);
+__declspec(dllimport) void* __stdcall VirtualAlloc(void* address, size_t size, unsigned long allocationType, unsigned long protect);
+__declspec(dllimport) int __stdcall VirtualFree(void* address, size_t size, unsigned long freeType);
+
+const unsigned long win32MemCommit = 0x1000;
+const unsigned long win32MemReserve = 0x2000;
+const unsigned long win32MemRelease = 0x8000;
+const unsigned long win32PageNoAccess = 0x01;
+const unsigned long win32PageReadWrite = 0x04;
+#else
+#include "sys/mman.h"
+#endif
+
+#if defined(__AVX2__)
+#include "immintrin.h"
+#elif defined(__SSE2__)
+#include "emmintrin.h"
+#endif
 
 
 const int screenWidth = 1200;
@@ -20,6 +69,7 @@ const int playerMaxHealth = 100;
 const double playerHealingPerSec = 5;
 
 const double expPerExp = 1;
+const double expPerLevel = 35;
 
 //Zombie default stats
 const double zDefMoveSpeed = 120.0;
@@ -34,23 +84,76 @@ const int zombieTypesCount = 4;
 const int zViewDistance = 300;
 const double zSeparation = 5;
 
+//AI tiers, zombies further from the player than each distance refresh their separation every 2nd, 4th and 8th tick
+const float aiTierDistances[3] = {750, 1100, 1600};
+
+//Zombie movement is updated this many zombies at a time, store capacities are rounded up to it
+const int zombieLanes = 8;
+
+//Job system, the main thread is worker 0
+const int maxWorkerCount = 16;
+const int jobDequeCapacity = 1024;
+const int zombieJobGrainSize = 64;
+const long long emptyRange = -1;
+
+//Zombie spatial grid, cells cover the map plus the spawn area outside the walls
+const int zGridCellSize = 100;
+const int zGridMargin = 400;
+
+//Flow field cell size, the field covers the same area as the zombie grid
+const int flowCellSize = 50;
+
 
 //Wave diffiulty
 const int difficulty = 20;
 const float rareZombieChance = 0.2;
-const int maxZombieCount = 2048;
 const double zombieSpawnDelay = 0.1;
 
+//Entity capacities, stores start at one chunk and grow a chunk at a time up to the maximum
+const int defaultMaxZombieCount = 32768;
+const int zombieChunkSize = 1024;
+const int defaultMaxBulletCount = 16384;
+const int bulletChunkSize = 256;
+const int particleChunkSize = 2048;
+
+//Linear arenas, only the pages that get used are committed
+const size_t persistentArenaBytes = (size_t)1 << 30;
+const size_t frameArenaBytes = (size_t)16 << 20;
+const size_t linearArenaAlignment = 16;
+
+//Horde size of the movement and vector math benchmarks
+const int benchZombieCount = 2048;
+
 const int fps = 160;
 
-//Guns 
-const int maxBulletCount = 1024;
+//Simulation runs at a fixed rate, frames draw between the last two ticks
+const int defaultTickRate = 60;
+const double maxFrameTime = 0.25;
 
 //Detailing
 const int environmentDetailLimit = 150;
 const int environmentDetailTypes = 2;
+const int maxDetailSize = 30;
+
+//Map detail is baked once into render texture tiles of this size
+const int backgroundTileSize = 512;
+
+//Batched drawing, batches go to rlgl in chunks that are whole quads and triangles
+const int batchChunkVertices = 4092;
+const int particleCircleSegments = 16;
+
+//Particles, the store is padded to whole kernel iterations
+const int defaultParticleCapacity = 16384;
+const int particleLanes = 8;
 
-const int particleLimit = 1024;
+//Experience orbs, a kill drops at most maxOrbsPerKill orbs and orbs sharing a merge cell become one
+const int maxOrbCount = 8192;
+const int orbChunkSize = 512;
+const int maxOrbsPerKill = 3;
+const float orbSize = 6;
+const double orbLifeTime = 25;
+const double orbMergeDelay = 0.5;
+const float orbMergeCellSize = 40;
 
 
 
@@ -67,6 +170,31 @@ typedef struct ZombieType {
     
 } ZombieType;
 
+//Zombies are stored as one array per field so movement can run over many zombies at once
+typedef struct ZombieStore {
+    int capacity;
+    int maxCapacity;
+    float* x;
+    float* y;
+    float* prevX;
+    float* prevY;
+    float* speed;
+    float* size;
+    float* health;
+    
+    //Steering of the last tick, the zombie is drawn facing along it
+    float* xChange;
+    float* yChange;
+    
+    //Push away from nearby zombies, refreshed on the zombie's AI ticks and reused in between
+    float* xSeparation;
+    float* ySeparation;
+    double* lastAttackTime;
+    float* pendingDamage;
+    int* type;
+} ZombieStore;
+
+//Old array of structs layout, kept for the movement benchmark
 typedef struct Zombie {
     int type;
     double currentHealth;
@@ -75,6 +203,98 @@ typedef struct Zombie {
     double lastAttackTime;
 } Zombie;
 
+//Fixed size slot pool, free slots are kept on a stack and live slots in a dense list
+typedef struct EntityPool {
+    int capacity;
+    int maxCapacity;
+    int activeCount;
+    int freeCount;
+    int slotsUsed;
+    int* freeSlots;
+    int* activeSlots;
+    int* activeIndex;
+    unsigned int* generation;
+} EntityPool;
+
+//Slot in the low 32 bits and the slot's generation in the high ones, the generation goes up every time the slot is released.
+//Generations start at 1 so 0 is never a handle.
+typedef unsigned long long EntityHandle;
+
+//Address ranges of every per-entity array of a session, released together
+typedef struct EntityArena {
+    int arrayCount;
+    void* arrays[64];
+    size_t reservedBytes[64];
+} EntityArena;
+
+//Bump allocator in one reservation. Nothing is freed on its own, the whole arena is reset or freed at once.
+typedef struct LinearArena {
+    unsigned char* base;
+    size_t used;
+    size_t committed;
+    size_t reserved;
+} LinearArena;
+
+//Chase-Lev work stealing deque of index ranges, the owner pushes and pops at the bottom, other workers steal from the top
+typedef struct WorkDeque {
+    atomic_llong top;
+    atomic_llong bottom;
+    atomic_llong* ranges;
+} WorkDeque;
+
+typedef void (*ParallelForFunction)(void* data, int start, int end, int worker);
+
+typedef struct JobSystem JobSystem;
+
+typedef struct WorkerThreadArgs {
+    JobSystem* jobs;
+    int worker;
+} WorkerThreadArgs;
+
+struct JobSystem {
+    int workerCount;
+    pthread_t* threads;
+    WorkerThreadArgs* threadArgs;
+    WorkDeque* deques;
+    
+    ParallelForFunction function;
+    void* data;
+    int grainSize;
+    atomic_int remaining;
+    
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    int generation;
+    bool running;
+};
+
+typedef struct ZombieGrid {
+    int columns;
+    int rows;
+    float originX;
+    float originY;
+    int* cellStart;
+    int* cellZombies;
+    int* zombieCell;
+} ZombieGrid;
+
+//Path toward the player for every cell, shared by all zombies and rebuilt when the player changes cell.
+//dirX/dirY point away from the next cell on the path, the same way as a zombie's steering.
+typedef struct FlowField {
+    int columns;
+    int rows;
+    float originX;
+    float originY;
+    int targetCell;
+    int blockedCount;
+    unsigned char* blocked;
+    unsigned char* lineOfSight;
+    int* distance;
+    float* dirX;
+    float* dirY;
+    int* queue;
+} FlowField;
+
 typedef struct Gun {
     int bulletCount;
     int rpm;
@@ -86,860 +306,3346 @@ typedef struct Gun {
     
 } Gun;
 
+//Zombies a bullet has hit. The first few are kept inline, after that they move to an open addressing table on the heap.
+//tableSize is 0 while the hits fit inline. A slot keeps its table after the bullet is gone, tableCapacity is its size.
+typedef struct HitSet {
+    int count;
+    int tableSize;
+    int tableCapacity;
+    EntityHandle inlineHits[8];
+    EntityHandle* table;
+} HitSet;
+
 typedef struct Bullet {
     Vector2 pos; 
+    Vector2 prevPos;
     int targetsLeft;
-    float direction;
     float xVel;
     float yVel;
     int gunIndex;
-    int zHitIndexes[15];
+    HitSet zombiesHit;
     double damage;
     
 } Bullet;
 
+//A zombie the bullet's path crosses this tick, t is how far along the path it enters the zombie
+typedef struct BulletHit {
+    float t;
+    int zombieIndex;
+} BulletHit;
+
 typedef struct MapDetail {
     Vector2 pos;
     int type;
     
 } MapDetail;
 
-typedef struct Particle {
-    int shape; 
-    int size;
-    int moveType;
-    Vector2 pos;
-    Vector2 vel;
-    Color color;
-    double deathTime;
-    double lifeTime;
-    double speed;
-    float rotation;
+//Cosmetic effects only, experience lives in the OrbStore.
+//Live particles are packed in [0, count), a dead particle is replaced by the last one.
+//life counts down to 0, drag is 1 for particles that slow down over their life and 0 for the rest.
+typedef struct ParticleStore {
+    int capacity;
+    int maxCapacity;
+    int count;
+    float *x, *y, *prevX, *prevY;
+    float *velX, *velY;
+    float *life, *lifeTime, *drag;
+    float *speed, *rotation, *size;
+    unsigned char* shape;
+    Color* color;
+} ParticleStore;
+
+//Experience orbs, packed like particles. value is the experience the orb gives when picked up.
+typedef struct OrbStore {
+    int capacity;
+    int maxCapacity;
+    int count;
+    float *x, *y, *prevX, *prevY;
+    float *velX, *velY;
+    float *life, *value;
+    
+    //Merge cell hash table, cellOrbs is -1 for an empty entry
+    long long* cellKeys;
+    int* cellOrbs;
+} OrbStore;
+
+//Game time: sampled from the monotonic clock once per frame, advanced once per tick
+typedef struct GameClock {
+    double lastSample;
+    double realDt;
+    double timeScale;
+    double now;
+    double dt;
+    bool paused;
+} GameClock;
+
+//Everything the simulation reads from the keyboard and mouse for one step
+typedef struct SimInput {
+    bool up;
+    bool down;
+    bool left;
+    bool right;
+    bool shoot;
+    float aimRotation;
+    int upgradePick;
+} SimInput;
+
+//One game session, advanced by SimulationStep and drawn by DrawGame
+//Parts of a tick that are timed on their own, draw is filled in by whoever draws
+typedef enum SimPhase {
+    phaseSpawn,
+    phaseZombieMove,
+    phaseAttack,
+    phaseBullets,
+    phaseParticles,
+    phaseDraw,
+    simPhaseCount
+} SimPhase;
+
+//persistentArena holds data that lives as long as the session, frameArena is reset at the start of every frame
+typedef struct GameState {
+    EntityArena arena;
+    LinearArena persistentArena;
+    LinearArena frameArena;
+    ZombieType zombieTypes[4];
+    Gun guns[7];
+    int gunsRollTickets[7];
+    Vector2 mapWalls[4];
+    
+    int wave;
+    int spawnedZombieCount;
+    double lastZombieSpawnTime;
+    float hitQueryRadius;
+    
+    ZombieStore zombies;
+    EntityPool zombiePool;
+    ZombieGrid zombieGrid;
+    FlowField flowField;
+    JobSystem* jobs;
+    int* nearbyZombies;
+    
+    Bullet* bullets;
+    EntityPool bulletPool;
+    BulletHit* bulletHits;
+    
+    ParticleStore particles;
+    OrbStore orbs;
+    
+    MapDetail* mapDetails;
+    int detailRandomizer;
+    
+    Vector2 playerPos;
+    Vector2 prevPlayerPos;
+    float playerRotation;
+    double playerHealth;
+    int playerLevel;
+    double playerExp;
+    double neededPlayerExp;
+    int playerDead;
+    
+    int currentGun;
+    int playerBonusStatsIndex;
+    double lastShotTime;
+    
+    int upgradeTime;
+    int upgradesCount;
+    int* upgradesPointer;
+    
+    GameClock clock;
+    long tick;
     
-} Particle;
+    //Seconds spent in each phase during the last tick
+    double phaseTime[simPhaseCount];
+} GameState;
+
+//Vertices for one kind of entity, filled every frame and sent to rlgl in one go
+typedef struct BatchVertex {
+    float x, y;
+    Color color;
+} BatchVertex;
+
+typedef struct DrawBatch {
+    int capacity;
+    int count;
+    BatchVertex* vertices;
+} DrawBatch;
+
+//Objects drawn and skipped by the view test in the last frame
+typedef struct CullStats {
+    int drawn;
+    int culled;
+} CullStats;
+
+//Tiles cover bounds in rows of columns, tile (column, row) starts at bounds.x + column*backgroundTileSize
+typedef struct BackgroundLayer {
+    Rectangle bounds;
+    int columns;
+    int rows;
+    RenderTexture2D* tiles;
+} BackgroundLayer;
+
+//A HUD widget keeps its last drawing in a texture and is only redrawn when the values it shows change
+typedef struct HudWidget {
+    RenderTexture2D texture;
+    int shown[2];
+} HudWidget;
+
+typedef struct HudLayer {
+    HudWidget expBar;
+    HudWidget healthBar;
+    HudWidget upgradeCards[3]; //One per upgrade choice
+} HudLayer;
+
+typedef struct RenderState {
+    DrawBatch zombieBatch;
+    DrawBatch bulletBatch;
+    DrawBatch particleBatch;
+    DrawBatch orbBatch;
+    Vector2 circlePoints[17];
+    BackgroundLayer background;
+    HudLayer hud;
+    
+    CullStats backgroundCull;
+    CullStats particleCull;
+    CullStats bulletCull;
+    CullStats zombieCull;
+    bool showCullStats;
+} RenderState;
+
+//Sizes picked on the command line, the most entities of each kind a session can hold
+typedef struct GameConfig {
+    int particleCapacity;
+    int zombieCapacity;
+    int bulletCapacity;
+} GameConfig;
+
+//Recorded session: "ZSRP", version, seed, tick rate and the particle, zombie and bullet capacities, then runs of identical tick inputs.
+//A run is a 16 bit length, a flags byte, the aim angle as raw float bits and the upgrade pick when there is one.
+typedef struct InputLog {
+    FILE* file;
+    unsigned int seed;
+    int tickRate;
+    GameConfig config;
+    long ticks;
+    
+    SimInput runInput;
+    int runLength;
+} InputLog;
 
 
 float GetAngle(Vector2 a, Vector2 b) {
     return atan2((a.y - b.y), (a.x - b.x))*(180/(float)PI);
 }
 
+//Float vector math for the hot paths. Directions are unit vectors and distances are compared squared,
+//angles are only made where something is drawn or where the mouse gives one.
+static inline Vector2 V2Add(Vector2 a, Vector2 b) {
+    Vector2 result = {a.x + b.x, a.y + b.y};
+    return(result);
+}
 
-float GetPos(float playerPos, float playerScreenPos, float objectPos) {
-    return (objectPos - playerPos + playerScreenPos); 
+static inline Vector2 V2Sub(Vector2 a, Vector2 b) {
+    Vector2 result = {a.x - b.x, a.y - b.y};
+    return(result);
 }
 
-int GenerateRandInt(int randNumMax) {
-    return rand() % randNumMax;
+static inline Vector2 V2Scale(Vector2 v, float scale) {
+    Vector2 result = {v.x*scale, v.y*scale};
+    return(result);
 }
 
-double GetCurrentTime() {
-    long currentClock = clock();
-    double timeSec = (double)currentClock/CLOCKS_PER_SEC;
-    
-    return (timeSec);
+static inline float V2Dot(Vector2 a, Vector2 b) {
+    return(a.x*b.x + a.y*b.y);
 }
 
-int Vector2Compare(Vector2 a, Vector2 b) {
-    if (a.x != b.x) {
-        return 0;
-    }
-    if (a.y != b.y) {
-        return 0;
-    }
-    return 1;
+//Positive when b is clockwise of a on screen (y points down)
+static inline float V2Cross(Vector2 a, Vector2 b) {
+    return(a.x*b.y - a.y*b.x);
 }
 
-int ChooseZombieType (ZombieType* zombieTypes, int wave) {
-    
-    int totalSpawnTickets = 0;
-    
-    for (int i = 0; i < zombieTypesCount; i++) {
-        if (zombieTypes[i].firstSpawnWave <= wave) {
-            totalSpawnTickets += zombieTypes[i].spawnTicketsCount;
-        }
-    }
-    
-    int spawnNum = GenerateRandInt(totalSpawnTickets);
-    
-    for (int i = 0; i < zombieTypesCount; i++) {
-        
-        spawnNum -= zombieTypes[i].spawnTicketsCount;
-        
-        if (spawnNum <= 0) {
-            return i;
-        }
-        
-    }
-    
-    return 0;
+static inline float V2LengthSqr(Vector2 v) {
+    return(v.x*v.x + v.y*v.y);
 }
 
-double SpawnZombie(Zombie* zombies, ZombieType* zombieTypes, int wave, double lastZombieSpawnTime, Vector2 defaultZombiePos) {
-    int zombieCount = difficulty * wave;
-    for (int i = 0; i < zombieCount; i++) {
-        
-        if (Vector2Compare(defaultZombiePos, zombies[i].pos)) {
-            
-            zombies[i].type = ChooseZombieType(zombieTypes, wave);
-            zombies[i].currentHealth = zombieTypes[zombies[i].type].health;
-            
-            int spawnPos = ((rand() % 4)); //4 becuase map has 4 walls that zombies can spawn at.
-            int spawnWidth = (rand() % mapWidth)-mapWidth/2;
-            int spawnHeight = (rand() % mapHeight)-mapHeight/2;
-            
-            if (spawnPos == 0) { //Top (-y)
-                zombies[i].pos.x = spawnWidth;
-                zombies[i].pos.y = -mapHeight/2-100;
-            } else if (spawnPos == 1) { //Right (+x)
-                zombies[i].pos.x = mapWidth/2+100;
-                zombies[i].pos.y = spawnHeight;
-            } else if (spawnPos == 2) { //Left (-x)
-                zombies[i].pos.x = -mapWidth/2-100;
-                zombies[i].pos.y = spawnHeight;
-            } else { //Bottom (+y)
-                zombies[i].pos.x = spawnWidth;
-                zombies[i].pos.y = mapHeight/2+100;
-            }
-            
-            zombies[i].direction = 0.0f;
-            zombies[i].lastAttackTime = 0.0;
-            
-            return (GetCurrentTime());
-            
-        }
-    }
-    
-    return (lastZombieSpawnTime);
+static inline float V2Length(Vector2 v) {
+    return(sqrtf(v.x*v.x + v.y*v.y));
 }
 
-double CreateZombie(Zombie* zombies, ZombieType* zombieTypes, int wave, double lastZombieSpawnTime, Vector2 defaultZombiePos) {
-    
-    if (zombieSpawnDelay + lastZombieSpawnTime <= GetCurrentTime()) {
-        lastZombieSpawnTime = SpawnZombie(zombies, zombieTypes, wave, lastZombieSpawnTime, defaultZombiePos);
-    }
-    
-    return(lastZombieSpawnTime);    
+static inline float V2DistanceSqr(Vector2 a, Vector2 b) {
+    return(V2LengthSqr(V2Sub(a, b)));
 }
+
+//A zero vector points along +x, the same way atan2(0, 0) did
+static inline Vector2 V2Normalize(Vector2 v) {
     
+    float lengthSqr = V2LengthSqr(v);
     
-
-
-double CalcCos(float v, double distance) {
-    float vRadians = v * PI / 180.0;
+    if (lengthSqr > 0) {
+        return(V2Scale(v, 1/sqrtf(lengthSqr)));
+    }
     
-    return(cos(vRadians)*distance);
+    Vector2 right = {1, 0};
+    return(right);
 }
 
-double CalcSin(float v, double distance) {
-    float vRadians = v * PI / 180.0;
-    
-    return(sin(vRadians)*distance);
+static inline Vector2 V2Rotate(Vector2 v, float cosA, float sinA) {
+    Vector2 result = {v.x*cosA - v.y*sinA, v.x*sinA + v.y*cosA};
+    return(result);
 }
 
-double CalcHypotenuse(double x, double y) {
-    return(sqrt(x*x + y*y));
+static inline Vector2 V2FromDegrees(float degrees) {
+    Vector2 result = {cosf(degrees*DEG2RAD), sinf(degrees*DEG2RAD)};
+    return(result);
 }
 
-double GetDistance(Vector2 a, Vector2 b) {
-    float xDist = a.x - b.x;
-    float yDist = a.y - b.y;
-    
-    return (sqrt(pow(xDist, 2) + pow(yDist, 2)));
+static inline float V2ToDegrees(Vector2 v) {
+    return(atan2f(v.y, v.x)*RAD2DEG);
 }
 
 
-int CheckPlayerHealth (double* playerHealth) {
-    
-    if (*playerHealth <= 0) {
-        return(1);
-    }
-    
-    return(0);
+float GetPos(float playerPos, float playerScreenPos, float objectPos) {
+    return (objectPos - playerPos + playerScreenPos); 
 }
 
+float LerpFloat(float previous, float current, float alpha) {
+    return (previous + (current - previous)*alpha);
+}
 
-void DamagePlayer (double* playerHealth, double damage) {
-
-    *playerHealth -= damage;
-    
+Vector2 LerpPos(Vector2 previous, Vector2 current, float alpha) {
+    Vector2 pos = {LerpFloat(previous.x, current.x, alpha), LerpFloat(previous.y, current.y, alpha)};
+    return pos;
 }
 
+int GenerateRandInt(int randNumMax) {
+    return rand() % randNumMax;
+}
 
-void ZombieAttackCheck(Zombie* zombies, int currentZombie, Vector2 playerPos, ZombieType* zombieTypes, double* playerHealth) {
+//Seconds since some fixed point, used for the game clock, the phase timers and the profiler
+double GetMonotonicTime() {
+#if defined(_WIN32)
+    static long long frequency = 0;
+    long long now;
     
-    double currentTime = GetCurrentTime();
-    
-    if (currentTime > zombies[currentZombie].lastAttackTime + zombieTypes[zombies[currentZombie].type].attackDelay) {
-        
-        double playerDistance = GetDistance(zombies[currentZombie].pos, playerPos);
-        
-        if (playerDistance < zombieTypes[zombies[currentZombie].type].size) {
-            
-            zombies[currentZombie].lastAttackTime = currentTime;
-            DamagePlayer(playerHealth, zombieTypes[zombies[currentZombie].type].damage);
-            
-        }
-        
+    if (frequency == 0) {
+        QueryPerformanceFrequency(&frequency);
     }
+    QueryPerformanceCounter(&now);
     
-}
-
-
-
-
-void MoveZombie(Zombie* zombies, int zombieIndex, Vector2 playerPos, ZombieType* zombieTypes, Vector2 defaultZombiePos) {
-    float v = GetAngle(zombies[zombieIndex].pos, playerPos);
-    
-    double xChange = CalcCos(v, zombieTypes[zombies[zombieIndex].type].speed);
-    double yChange = CalcSin(v, zombieTypes[zombies[zombieIndex].type].speed);
+    return ((double)now / frequency);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
     
-    for (int i = 0; i<maxZombieCount; i++) {
-        
-        if (!Vector2Compare(zombies[i].pos, defaultZombiePos) && i != zombieIndex) {
-            
-            double cDist = GetDistance(zombies[i].pos, zombies[zombieIndex].pos);
+    return (now.tv_sec + now.tv_nsec / 1000000000.0);
+#endif
+}
 
-            if (cDist < zViewDistance) { 
-                float xDist = zombies[i].pos.x - zombies[zombieIndex].pos.x;
-                float yDist = zombies[i].pos.y - zombies[zombieIndex].pos.y;
-                xChange += xDist*zSeparation/cDist;
-                yChange += yDist*zSeparation/cDist;
-            }
-        }
+//Profiler: build with -DENABLE_PROFILER to get PROFILE_SCOPE timers, the F3 overlay and --trace trace.json.
+//Without the flag the macros are empty. With it but switched off a scope is one branch on profiler.active.
+//Scopes are only put on the main thread, the zone table is not locked.
+#if defined(ENABLE_PROFILER)
+
+#define PROFILER_MAX_ZONES 48
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+
+typedef struct ProfileZone {
+    const char* name;
+    double frameTime;
+    int frameCalls;
+    double averageTime;
+    int lastCalls;
+} ProfileZone;
+
+//Complete events for the trace, times in seconds from GetMonotonicTime
+typedef struct TraceEvent {
+    const char* name;
+    double start;
+    double duration;
+} TraceEvent;
+
+typedef struct Profiler {
+    bool active;
+    bool showOverlay;
+    int zoneCount;
+    ProfileZone zones[PROFILER_MAX_ZONES];
+    
+    const char* tracePath;
+    TraceEvent* traceEvents;
+    int traceCount;
+    int traceCapacity;
+    int traceDropped;
+    double traceStart;
+} Profiler;
+
+typedef struct ProfileScope {
+    int zone;
+    double start;
+} ProfileScope;
+
+const int maxTraceEvents = 1 << 20;
+
+Profiler profiler;
+
+int RegisterProfileZone(const char* name) {
+    
+    if (profiler.zoneCount == PROFILER_MAX_ZONES) {
+        return(-1);
     }
     
-    Vector2 zTarget = {xChange, yChange};
-    Vector2 self = {0, 0};
+    ProfileZone* zone = &profiler.zones[profiler.zoneCount];
+    memset(zone, 0, sizeof(ProfileZone));
+    zone->name = name;
     
-    v = GetAngle(zTarget, self);
-
-
-    zombies[zombieIndex].pos.x -= (xChange*GetFrameTime());
-    zombies[zombieIndex].pos.y -= (yChange*GetFrameTime());
-    zombies[zombieIndex].direction = v;
-
+    return(profiler.zoneCount++);
 }
 
-void DrawZombie(Zombie* zombies, int zombieIndex, ZombieType* zombieTypes, Vector2 playerPos, Vector2 playerScreenPos){
-    
-    int zombieSize = zombieTypes[zombies[zombieIndex].type].size;
-    float zombieScreenX = GetPos(playerPos.x, playerScreenPos.x, zombies[zombieIndex].pos.x);
-    float zombieScreenY = GetPos(playerPos.y, playerScreenPos.y, zombies[zombieIndex].pos.y);
+//zoneIndex is a static next to the scope, so every scope looks its zone up once
+ProfileScope BeginProfileScope(int* zoneIndex, const char* name) {
     
+    ProfileScope scope = {-1, 0};
     
-    Rectangle zombieRec = {zombieScreenX, zombieScreenY, zombieSize, zombieSize};
-    Rectangle outlineRec = {zombieScreenX, zombieScreenY, zombieSize + 8, zombieSize + 8};
-    Vector2 zombieOffset = {zombieSize/2, zombieSize/2};
-    Vector2 outlineOffset = {zombieSize/2 + 4, zombieSize/2 + 4};
+    if (!profiler.active) {
+        return(scope);
+    }
     
-    //Draw outline
-    DrawRectanglePro(outlineRec, outlineOffset, zombies[zombieIndex].direction, BLACK);
+    if (*zoneIndex == -1) {
+        *zoneIndex = RegisterProfileZone(name);
+    }
     
-    //Draw Zombie
-    DrawRectanglePro(zombieRec, zombieOffset, zombies[zombieIndex].direction, zombieTypes[zombies[zombieIndex].type].color);
+    scope.zone = *zoneIndex;
+    scope.start = GetMonotonicTime();
     
-
+    return(scope);
 }
 
-void ResetZombie(Zombie* zombies, int currentZombie, Vector2 defaultZombiePos) {
-    zombies[currentZombie].pos = defaultZombiePos;
+//Runs when the scope variable goes out of scope
+void EndProfileScope(ProfileScope* scope) {
+    
+    if (scope->zone < 0) {
+        return;
+    }
+    
+    double duration = GetMonotonicTime() - scope->start;
+    ProfileZone* zone = &profiler.zones[scope->zone];
+    zone->frameTime += duration;
+    zone->frameCalls++;
+    
+    if (profiler.traceEvents != NULL) {
+        if (profiler.traceCount < profiler.traceCapacity) {
+            TraceEvent* event = &profiler.traceEvents[profiler.traceCount++];
+            event->name = zone->name;
+            event->start = scope->start;
+            event->duration = duration;
+        } else {
+            profiler.traceDropped++;
+        }
+    }
+    
 }
 
+#define PROFILE_SCOPE(name) \
+    static int PROFILE_CONCAT(profileZone, __LINE__) = -1; \
+    ProfileScope PROFILE_CONCAT(profileScope, __LINE__) __attribute__((cleanup(EndProfileScope))) = BeginProfileScope(&PROFILE_CONCAT(profileZone, __LINE__), name)
 
-void CreateBullets(Gun* guns, int currentGun, Bullet* bullet, float direction, Vector2 origin, Vector2 bulletDefaultPos, int playerBonusStatsIndex) {
+//Folds this frame's times into the averages the overlay shows
+void EndProfilerFrame() {
     
-    for (int i = 0; i < (guns[currentGun].bulletCount + guns[playerBonusStatsIndex].bulletCount); i++) {
-        float accuracy = (GenerateRandInt(201)-100)/(guns[currentGun].accuracy + guns[playerBonusStatsIndex].accuracy);
-        
-        for (int j = 0; j < maxBulletCount; j++) {
-            
-            if (Vector2Compare(bullet[j].pos, bulletDefaultPos)) {
-                bullet[j].pos = origin;
-                bullet[j].direction = direction + accuracy;
-                
-                bullet[j].xVel = CalcCos(bullet[j].direction, (guns[currentGun].speed + guns[playerBonusStatsIndex].speed));
-                bullet[j].yVel = CalcSin(bullet[j].direction, (guns[currentGun].speed + guns[playerBonusStatsIndex].speed));
-                bullet[j].targetsLeft = guns[currentGun].penetration + guns[playerBonusStatsIndex].penetration;
-                bullet[j].gunIndex = currentGun;
-                bullet[j].damage = guns[currentGun].damage + guns[playerBonusStatsIndex].damage;
-                
-                break;
-            }
-        }
+    for (int i = 0; i < profiler.zoneCount; i++) {
+        ProfileZone* zone = &profiler.zones[i];
+        zone->averageTime = zone->averageTime*0.95 + zone->frameTime*0.05;
+        zone->lastCalls = zone->frameCalls;
+        zone->frameTime = 0;
+        zone->frameCalls = 0;
     }
+    
+}
+
+void ToggleProfilerOverlay() {
+    profiler.showOverlay = !profiler.showOverlay;
+    profiler.active = profiler.showOverlay || profiler.traceEvents != NULL;
 }
 
-void DrawBullet(Gun* guns, Bullet* bullet, int currentBullet, Vector2 playerPos, Vector2 playerScreenPos, int playerBonusStatsIndex) {
+void DrawProfilerOverlay() {
     
-    int bulletSize = guns[bullet[currentBullet].gunIndex].bulletSize + guns[playerBonusStatsIndex].bulletSize;
-    float bulletScreenX = GetPos(playerPos.x, playerScreenPos.x, bullet[currentBullet].pos.x);
-    float bulletScreenY = GetPos(playerPos.y, playerScreenPos.y, bullet[currentBullet].pos.y);
+    if (!profiler.showOverlay) {
+        return;
+    }
     
-    Vector2 bulletScreenPos = {bulletScreenX, bulletScreenY};
+    int lineHeight = 16;
+    int x = screenWidth - 330;
+    int y = 30;
+    char text[BUFSIZ];
     
-    DrawPoly(bulletScreenPos, 3, bulletSize, bullet[currentBullet].direction-30, BLACK);          
+    DrawRectangle(x - 8, y - 6, 330, profiler.zoneCount*lineHeight + 30, (Color){0, 0, 0, 160});
+    DrawText("zone                     ms   calls", x, y, 14, WHITE);
     
+    for (int i = 0; i < profiler.zoneCount; i++) {
+        ProfileZone* zone = &profiler.zones[i];
+        sprintf(text, "%-20s %8.3f %6d", zone->name, zone->averageTime*1000, zone->lastCalls);
+        DrawText(text, x, y + (i + 1)*lineHeight, 14, WHITE);
+    }
     
 }
 
-double Shoot(Gun* guns, int currentGun, double lastShotTime, Bullet* bullet, Vector2 playerPos, Vector2 defaultBulletPos, float playerRotation, int playerBonusStatsIndex) {
-
-    double minute = 60.0;
-    double currentTime = GetCurrentTime();
+void WriteProfilerTrace() {
     
+    FILE* file = fopen(profiler.tracePath, "w");
     
-    if (currentTime - lastShotTime > minute/(guns[currentGun].rpm + guns[playerBonusStatsIndex].rpm)) {
-        
-        CreateBullets(guns, currentGun, bullet, playerRotation, playerPos, defaultBulletPos, playerBonusStatsIndex);
-        return currentTime;
+    if (file == NULL) {
+        printf("Could not write %s\n", profiler.tracePath);
+        return;
     }
     
-    return lastShotTime;
+    //Chrome and Perfetto read "X" events with microsecond times
+    fprintf(file, "{\"traceEvents\": [\n");
+    
+    for (int i = 0; i < profiler.traceCount; i++) {
+        TraceEvent* event = &profiler.traceEvents[i];
+        fprintf(file, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f}%s\n", event->name, (event->start - profiler.traceStart)*1000000, event->duration*1000000, (i + 1 < profiler.traceCount) ? "," : "");
+    }
+    
+    fprintf(file, "], \"displayTimeUnit\": \"ms\"}\n");
+    fclose(file);
+    
+    printf("Wrote %d trace events to %s", profiler.traceCount, profiler.tracePath);
+    if (profiler.traceDropped > 0) {
+        printf(", %d more did not fit", profiler.traceDropped);
+    }
+    printf("\n");
+    
+    free(profiler.traceEvents);
+    profiler.traceEvents = NULL;
     
 }
 
-void ResetBullet(Bullet* bullet, int currentBullet, Vector2 defaultBulletPos) {
-    bullet[currentBullet].pos = defaultBulletPos;
-    bullet[currentBullet].xVel = 0;
-    bullet[currentBullet].yVel = 0;
+//Records from now until the program exits, whichever mode it runs in
+void StartProfilerTrace(const char* path) {
     
-    int collisionArrayLength = sizeof(bullet[0].zHitIndexes) / sizeof(bullet[0].zHitIndexes[0]);
+    profiler.tracePath = path;
+    profiler.traceEvents = malloc(maxTraceEvents * sizeof(TraceEvent));
+    profiler.traceCapacity = maxTraceEvents;
+    profiler.traceCount = 0;
+    profiler.traceStart = GetMonotonicTime();
+    profiler.active = true;
     
-    for (int i = 0; i < collisionArrayLength; i++) {
-        bullet[currentBullet].zHitIndexes[i] = -1;
-    }
+    atexit(WriteProfilerTrace);
     
 }
 
-void MoveBullet(Bullet* bullet, int currentBullet, Vector2 defaultBulletPos, Vector2 playerPos) {
-    bullet[currentBullet].pos.x -= bullet[currentBullet].xVel*GetFrameTime();
-    bullet[currentBullet].pos.y -= bullet[currentBullet].yVel*GetFrameTime();
+#define PROFILER_END_FRAME() EndProfilerFrame()
+#define PROFILER_TOGGLE_OVERLAY() ToggleProfilerOverlay()
+#define PROFILER_DRAW_OVERLAY() DrawProfilerOverlay()
+
+#else
+
+#define PROFILE_SCOPE(name)
+#define PROFILER_END_FRAME()
+#define PROFILER_TOGGLE_OVERLAY()
+#define PROFILER_DRAW_OVERLAY()
+
+#endif
+
+void InitGameClock(GameClock* gameClock) {
+    gameClock->lastSample = GetMonotonicTime();
+    gameClock->realDt = 0;
+    gameClock->timeScale = 1.0;
+    gameClock->now = 0;
+    gameClock->dt = 0;
+    gameClock->paused = false;
+}
+
+//Called once per frame, returns the scaled wall time since the last frame for the tick accumulator
+double SampleGameClock(GameClock* gameClock, double maxRealDt) {
     
-    int bulletDespawnDistance = screenWidth/2 + 100;
+    double sample = GetMonotonicTime();
     
-    if (bullet[currentBullet].pos.x > playerPos.x + bulletDespawnDistance) {
-        ResetBullet(bullet, currentBullet, defaultBulletPos);
-    } else if (bullet[currentBullet].pos.x < playerPos.x - bulletDespawnDistance){
-        ResetBullet(bullet, currentBullet, defaultBulletPos);    
-    }
+    gameClock->realDt = sample - gameClock->lastSample;
+    gameClock->lastSample = sample;
     
-    if (bullet[currentBullet].pos.y > playerPos.y + bulletDespawnDistance) {
-        ResetBullet(bullet, currentBullet, defaultBulletPos);
-    } else if (bullet[currentBullet].pos.y < playerPos.y - bulletDespawnDistance){
-        ResetBullet(bullet, currentBullet, defaultBulletPos);
+    //Long frames are cut short instead of running many ticks to catch up
+    if (gameClock->realDt > maxRealDt) {
+        gameClock->realDt = maxRealDt;
     }
     
+    return (gameClock->realDt * gameClock->timeScale);
 }
 
-int CollisionCheckBullet(Vector2 bulletPos, Zombie* zombies, ZombieType* zombieTypes, int currentZombie) {
+//Called once per tick, everything in the simulation reads now and dt from here
+void AdvanceGameClock(GameClock* gameClock, double tickTime) {
     
-    int maxCheckDistance = 100;
-    int distance = abs(GetDistance(bulletPos, zombies[currentZombie].pos));
-    
-    if (distance < maxCheckDistance) {
-        
-        int zombieSize = zombieTypes[zombies[currentZombie].type].size;
-        
-        float zombieX = zombies[currentZombie].pos.x;
-        float zombieY = zombies[currentZombie].pos.y;
-        
-        Rectangle zombieRec = {zombieX - zombieSize/2, zombieY - zombieSize/2, zombieSize, zombieSize};
-        
-        if (CheckCollisionPointRec(bulletPos, zombieRec)) {
-
-            return(currentZombie);
-        }
-        
+    if (gameClock->paused) {
+        gameClock->dt = 0;
+    } else {
+        gameClock->dt = tickTime;
     }
     
-    return(-1);
+    gameClock->now += gameClock->dt;
     
 }
 
-
-
-void DrawParticle(Vector2 particlePos, int size, float direction, Color color, int shape, Vector2 playerPos, Vector2 playerScreenPos) {
-
-    if (shape == 0) {
-        DrawCircle(GetPos(playerPos.x, playerScreenPos.x, particlePos.x), GetPos(playerPos.y, playerScreenPos.y, particlePos.y), size, color);
-    }
-    else if (shape == 1) {
-        Rectangle particleRec = {particlePos.x, particlePos.y, size, size};
-        particlePos.x -= size/2;
-        particlePos.y -= size/2;
-        DrawRectanglePro(particleRec, particlePos, direction, color);
-    }
+void SetGameClockPaused(GameClock* gameClock, bool paused) {
+    gameClock->paused = paused;
 }
 
-Vector2 SetParticleVel(Vector2 originVel, float velChangeMax) {
-
-    Vector2 returnVel = originVel;
+void SetGameClockScale(GameClock* gameClock, double timeScale) {
+    gameClock->timeScale = timeScale;
+}
 
-    float velChangePercent = (float)GenerateRandInt(100)/100; 
-    returnVel.x += (velChangeMax/2 - velChangeMax * velChangePercent);
+//Address space is reserved up front and committed a page range at a time.
+//Reserved pages fault when touched, committed pages start zeroed.
+size_t GetPageSize() {
+#if defined(_WIN32)
+    Win32SystemInfo info;
+    GetSystemInfo(&info);
+    return(info.pageSize);
+#else
+    return(sysconf(_SC_PAGESIZE));
+#endif
+}
 
-    velChangePercent = (float)GenerateRandInt(100)/100; 
-    returnVel.y += (velChangeMax/2 - velChangeMax * velChangePercent);
-    
-    return returnVel;
-    
+//Returns NULL when the address space could not be reserved
+void* ReservePages(size_t bytes) {
+#if defined(_WIN32)
+    return(VirtualAlloc(NULL, bytes, win32MemReserve, win32PageNoAccess));
+#else
+    void* pages = mmap(NULL, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return(pages == MAP_FAILED ? NULL : pages);
+#endif
 }
 
-double SetParticleLifeTime(double lifeTime, double lifeTimeDiffMax) {
-    
-    double lifeTimeChangePercent = (double)GenerateRandInt(100)/100; 
-    double returnTime = lifeTime + (lifeTimeDiffMax/2 - lifeTimeDiffMax * lifeTimeChangePercent);
+bool CommitPages(void* address, size_t bytes) {
+#if defined(_WIN32)
+    return(VirtualAlloc(address, bytes, win32MemCommit, win32PageReadWrite) != NULL);
+#else
+    return(mprotect(address, bytes, PROT_READ | PROT_WRITE) == 0);
+#endif
+}
 
-    return returnTime;
-    
+void ReleasePages(void* address, size_t bytes) {
+#if defined(_WIN32)
+    VirtualFree(address, 0, win32MemRelease);
+#else
+    munmap(address, bytes);
+#endif
 }
 
+size_t RoundUpToPages(size_t bytes) {
+    size_t pageSize = GetPageSize();
+    return ((bytes + pageSize - 1) / pageSize) * pageSize;
+}
 
-void CreateParticles(Particle* particles, Vector2 originPos, Vector2 originVel, float velChangeMax, int shape, Color color, int size, int count, float rotation, double lifeTime, double lifeTimeDiffMax, int type) {
+//Makes the first newCount elements usable, the pages behind oldCount are already committed
+bool CommitEntityArray(void* array, size_t elementSize, int oldCount, int newCount) {
     
-    double currentTime = GetCurrentTime();
+    size_t oldBytes = RoundUpToPages(elementSize * oldCount);
+    size_t newBytes = RoundUpToPages(elementSize * newCount);
     
-    for (int i = 0; i < count; i++) {
-        
-        for (int j = 0; j < particleLimit; j++) {
-            
-            if (particles[j].deathTime < currentTime) {
-                
-                particles[j].pos = originPos;
-                particles[j].size = size;
-                particles[j].shape = shape;
-                particles[j].color = color;
-                particles[j].vel = SetParticleVel(originVel, velChangeMax);
-                particles[j].lifeTime = SetParticleLifeTime(lifeTime, lifeTimeDiffMax);
-                particles[j].deathTime = currentTime + particles[j].lifeTime;
-                particles[j].moveType = type;
-                particles[j].speed = CalcHypotenuse(particles[j].vel.x, particles[j].vel.y);
-                
-                if (rotation != 0) {
-                    particles[j].rotation = rotation;
-                } else {
-                    Vector2 zero = {0, 0};
-                    particles[j].rotation = GetAngle(zero, particles[j].vel);
-                }
-
-                
-                break;
-                
-            }
-            
-        }
-        
+    if (newBytes <= oldBytes) {
+        return(true);
     }
     
+    return(CommitPages((unsigned char*)array + oldBytes, newBytes - oldBytes));
 }
 
-
-void DrawAllParticles (Particle* particles, Vector2 playerPos, Vector2 playerScreenPos) {
-    double currentTime = GetCurrentTime();
+//Every array gets its own address range, big enough for maxCount elements, and only the first count are committed.
+//Growing commits more of the same range, so entities never move and anything past the committed part faults instead of corrupting memory.
+//Ranges start on a page, which also lines them up with the cache lines. Fresh pages are zeroed.
+void* ReserveEntityArray(EntityArena* arena, size_t elementSize, int maxCount, int count) {
     
-    for (int i = 0; i < particleLimit; i++) {
-        
-        if (particles[i].deathTime > currentTime) {
-
-            DrawParticle(particles[i].pos, particles[i].size, particles[i].rotation, particles[i].color, particles[i].shape, playerPos, playerScreenPos); 
-            
-        }
-        
+    int arenaSize = sizeof(arena->arrays) / sizeof(arena->arrays[0]);
+    size_t reservedBytes = RoundUpToPages(elementSize * (maxCount > 0 ? maxCount : 1));
+    void* array = ReservePages(reservedBytes);
+    
+    if (array == NULL || arena->arrayCount == arenaSize || !CommitEntityArray(array, elementSize, 0, count)) {
+        printf("Could not reserve %zu bytes for entities\n", reservedBytes);
+        exit(1);
     }
     
+    arena->arrays[arena->arrayCount] = array;
+    arena->reservedBytes[arena->arrayCount] = reservedBytes;
+    arena->arrayCount++;
+    
+    return(array);
 }
 
-void MoveParticleLinear(Particle* particles, int currentParticle) {
-    
-    particles[currentParticle].pos.x -= particles[currentParticle].vel.x * GetFrameTime();
-    particles[currentParticle].pos.y -= particles[currentParticle].vel.y * GetFrameTime();
-    
+void InitEntityArena(EntityArena* arena) {
+    arena->arrayCount = 0;
 }
 
-void MoveParticleSlowDown(Particle* particles, int currentParticle) {
-    
-    particles[currentParticle].pos.x -= particles[currentParticle].vel.x * GetFrameTime();
-    particles[currentParticle].pos.y -= particles[currentParticle].vel.y * GetFrameTime();
+void FreeEntityArena(EntityArena* arena) {
     
+    for (int i = 0; i < arena->arrayCount; i++) {
+        ReleasePages(arena->arrays[i], arena->reservedBytes[i]);
+    }
     
-    double currentTime = GetCurrentTime();
+    arena->arrayCount = 0;
     
-    double remainingLife = particles[currentParticle].deathTime - currentTime;
-    double remainingLifePercent = remainingLife/particles[currentParticle].lifeTime;
+}
+
+void InitLinearArena(LinearArena* arena, size_t reservedBytes) {
     
-    particles[currentParticle].vel.x = particles[currentParticle].vel.x * remainingLifePercent;
-    particles[currentParticle].vel.y = particles[currentParticle].vel.y * remainingLifePercent;
+    arena->reserved = RoundUpToPages(reservedBytes);
+    arena->base = ReservePages(arena->reserved);
+    arena->used = 0;
+    arena->committed = 0;
     
+    if (arena->base == NULL) {
+        printf("Could not reserve %zu bytes for an arena\n", arena->reserved);
+        exit(1);
+    }
 }
 
-float SlowTurn(float turnAngle, float rotationPerSecond) {
+//Memory is not cleared, a reset arena hands back what it handed out before
+void* PushLinearArena(LinearArena* arena, size_t bytes) {
     
-    double rotationCurrentFrame = rotationPerSecond * GetFrameTime();
+    size_t start = (arena->used + linearArenaAlignment - 1) & ~(linearArenaAlignment - 1);
+    size_t end = start + bytes;
     
-    if (turnAngle > 0) {
-        
-        return(rotationCurrentFrame);
+    if (end > arena->committed) {
         
-    } else {
+        size_t committed = RoundUpToPages(end);
         
-        return(-rotationCurrentFrame);
+        if (committed > arena->reserved || !CommitPages(arena->base + arena->committed, committed - arena->committed)) {
+            printf("Arena of %zu bytes is out of space\n", arena->reserved);
+            exit(1);
+        }
         
+        arena->committed = committed;
     }
     
+    arena->used = end;
+    return(arena->base + start);
 }
 
-void ResetParticle(Particle* particles, int currentParticle) {
-    
-    particles[currentParticle].deathTime = 0; 
-    particles[currentParticle].speed = 0; 
-    particles[currentParticle].rotation = 0;
-    
+void ResetLinearArena(LinearArena* arena) {
+    arena->used = 0;
 }
 
-int CollisionCheckParticle(Particle* particles, int currentParticle, Vector2 target, float targetOffset) {
-    
-    
-    Rectangle playerRec = {target.x - targetOffset/2, target.y - targetOffset/2, playerSize, playerSize};
+void FreeLinearArena(LinearArena* arena) {
+    ReleasePages(arena->base, arena->reserved);
+    arena->base = NULL;
+    arena->used = 0;
+    arena->committed = 0;
+}
+
+//Next capacity of a store that has run out of slots, 0 when it is already at its maximum
+int GetGrownCapacity(int capacity, int maxCapacity, int chunkSize) {
     
-    if (CheckCollisionCircleRec(particles[currentParticle].pos, particles[currentParticle].size, playerRec)) {
-        return(1);
-    } else {
+    if (capacity >= maxCapacity) {
         return(0);
+    } else if (capacity + chunkSize > maxCapacity) {
+        return(maxCapacity);
     }
     
+    return(capacity + chunkSize);
 }
 
-void MoveParticleTowardsTargetSlow(Particle* particles, int currentParticle, Vector2 target, double* playerExpPointer) {
+bool GrowEntityPool(EntityPool* pool, int capacity) {
     
-    float targetOffset = playerSize;
+    int oldCapacity = pool->capacity;
     
-    if (CollisionCheckParticle(particles, currentParticle, target, targetOffset)) {
-        ResetParticle(particles, currentParticle);
-        *playerExpPointer += expPerExp;
+    if (capacity <= oldCapacity) {
+        return(true);
     }
     
-    float targetAngle = GetAngle(target, particles[currentParticle].pos);
-    float currentAngle = particles[currentParticle].rotation;
-
+    if (capacity > pool->maxCapacity || !CommitEntityArray(pool->freeSlots, sizeof(int), oldCapacity, capacity) || !CommitEntityArray(pool->activeSlots, sizeof(int), oldCapacity, capacity) || !CommitEntityArray(pool->activeIndex, sizeof(int), oldCapacity, capacity) || !CommitEntityArray(pool->generation, sizeof(unsigned int), oldCapacity, capacity)) {
+        return(false);
+    }
     
-    float angleDiff = targetAngle - currentAngle;
+    //Lowest slots are handed out first, the new slots go under the free ones since they are all higher
+    int addedCount = capacity - oldCapacity;
+    memmove(pool->freeSlots + addedCount, pool->freeSlots, pool->freeCount * sizeof(int));
     
-    if (angleDiff > 180) {
-        angleDiff -= 360.0f;
-    } else if (angleDiff < -180) {
-        angleDiff += 360.0f;
+    for (int i = 0; i < addedCount; i++) {
+        pool->freeSlots[i] = capacity - 1 - i;
+        pool->activeIndex[oldCapacity + i] = -1;
+        pool->generation[oldCapacity + i] = 1;
     }
     
-    float rotationPerSecond = 360;
+    pool->freeCount += addedCount;
+    pool->capacity = capacity;
+    
+    return(true);
+}
+
+void InitEntityPool(EntityPool* pool, EntityArena* arena, int capacity, int maxCapacity) {
+    
+    pool->capacity = 0;
+    pool->maxCapacity = maxCapacity;
+    pool->activeCount = 0;
+    pool->freeCount = 0;
+    pool->slotsUsed = 0;
+    pool->freeSlots = ReserveEntityArray(arena, sizeof(int), maxCapacity, 0);
+    pool->activeSlots = ReserveEntityArray(arena, sizeof(int), maxCapacity, 0);
+    pool->activeIndex = ReserveEntityArray(arena, sizeof(int), maxCapacity, 0);
+    pool->generation = ReserveEntityArray(arena, sizeof(unsigned int), maxCapacity, 0);
+    
+    GrowEntityPool(pool, (capacity < maxCapacity) ? capacity : maxCapacity);
+    
+}
+
+//Returns the allocated slot, or -1 if the pool is full
+int AllocateEntity(EntityPool* pool) {
+    
+    if (pool->freeCount == 0) {
+        return(-1);
+    }
     
-    particles[currentParticle].rotation -= SlowTurn(angleDiff, rotationPerSecond);
+    pool->freeCount--;
+    int slot = pool->freeSlots[pool->freeCount];
     
-    if (particles[currentParticle].rotation > 180) {
-        particles[currentParticle].rotation = -(360 - particles[currentParticle].rotation);
-    } else if (particles[currentParticle].rotation < -180) {
-        particles[currentParticle].rotation = 360 + particles[currentParticle].rotation;
+    if (slot >= pool->slotsUsed) {
+        pool->slotsUsed = slot + 1;
     }
     
-    particles[currentParticle].pos.x -= CalcCos(particles[currentParticle].rotation, particles[currentParticle].speed)*GetFrameTime();
-    particles[currentParticle].pos.y -= CalcSin(particles[currentParticle].rotation, particles[currentParticle].speed)*GetFrameTime();
+    pool->activeIndex[slot] = pool->activeCount;
+    pool->activeSlots[pool->activeCount] = slot;
+    pool->activeCount++;
     
+    return(slot);
 }
 
-void MoveAllParticles (Particle* particles, Vector2 playerPos, double* playerExpPointer) {
-    double currentTime = GetCurrentTime();
+//Takes up to count slots in one go and returns how many it got.
+//They are the same slots count calls to AllocateEntity would hand out, and end up as the last entries of activeSlots.
+int AllocateEntities(EntityPool* pool, int count) {
+    
+    if (count > pool->freeCount) {
+        count = pool->freeCount;
+    }
     
-    for (int i = 0; i < particleLimit; i++) {
+    for (int n = 0; n < count; n++) {
         
-        if (particles[i].deathTime > currentTime) {
-            
-            if (particles[i].moveType == 0) { 
-            
-                MoveParticleLinear(particles, i);
-                
-            } else if (particles[i].moveType == 1) {
-                
-                MoveParticleSlowDown(particles, i);
-                
-            } else if (particles[i].moveType == 2) {
-                
-                MoveParticleTowardsTargetSlow(particles, i, playerPos, playerExpPointer);
-                
-            } else if (particles[i].moveType == 3) {
-                
-                MoveParticleTowardsTargetSlow(particles, i, playerPos, playerExpPointer);
-                
-            }
-            
+        int slot = pool->freeSlots[pool->freeCount - 1 - n];
+        
+        if (slot >= pool->slotsUsed) {
+            pool->slotsUsed = slot + 1;
         }
         
+        pool->activeIndex[slot] = pool->activeCount + n;
+        pool->activeSlots[pool->activeCount + n] = slot;
     }
     
+    pool->freeCount -= count;
+    pool->activeCount += count;
+    
+    return(count);
 }
 
-
-void AddBloodExplosion(Particle* particles, Color color, Vector2 bulletVel, Vector2 bulletPos, int zombieSize) {
+//The last live slot is moved into the released one's place, so loops that release while iterating go backwards
+void ReleaseEntity(EntityPool* pool, int slot) {
     
-    int bloodCount = zombieSize/4;
-    float velChangeMax = 45*zombieSize;
-    float rotation = 0;
-    int shape = 0;
-    int size = zombieSize/8;
-    double bloodLifeTime = 2.0;
-    double LifeTimeDiffMax = 0.25;
-    int moveType = 1;
+    int index = pool->activeIndex[slot];
+    int lastSlot = pool->activeSlots[pool->activeCount - 1];
     
-    CreateParticles(particles, bulletPos, bulletVel, velChangeMax, shape, color, size, bloodCount, rotation, bloodLifeTime, LifeTimeDiffMax, moveType);
+    pool->activeSlots[index] = lastSlot;
+    pool->activeIndex[lastSlot] = index;
+    pool->activeIndex[slot] = -1;
+    pool->activeCount--;
+    
+    //Handles to the old entity stop matching, 0 is skipped when the counter wraps
+    pool->generation[slot]++;
+    if (pool->generation[slot] == 0) {
+        pool->generation[slot] = 1;
+    }
+    
+    pool->freeSlots[pool->freeCount] = slot;
+    pool->freeCount++;
     
 }
 
-void AddExperienceExplosion(Particle* particles, Color color, Vector2 bulletVel, Vector2 bulletPos, int zombieExpCount) {
+bool IsEntityActive(EntityPool* pool, int slot) {
+    return(pool->activeIndex[slot] != -1);
+}
+
+EntityHandle GetEntityHandle(EntityPool* pool, int slot) {
+    return(((EntityHandle)pool->generation[slot] << 32) | (unsigned int)slot);
+}
+
+int GetHandleSlot(EntityHandle handle) {
+    return((int)(handle & 0xffffffff));
+}
+
+//False once the entity the handle was made for has been released, even if the slot is in use again
+bool IsHandleActive(EntityPool* pool, EntityHandle handle) {
     
-    float velChangeMax = 1500;
-    float rotation = 0;
-    int shape = 0;
-    int size = 6;
-    double lifeTime = 25;
-    double LifeTimeDiffMax = 0.25;
-    int moveType = 2;
-    Color experienceColor = GOLD;
+    int slot = GetHandleSlot(handle);
     
-    CreateParticles(particles, bulletPos, bulletVel, velChangeMax, shape, experienceColor, size, zombieExpCount, rotation, lifeTime, LifeTimeDiffMax, moveType);
+    if (slot < 0 || slot >= pool->capacity) {
+        return(false);
+    }
     
+    return(IsEntityActive(pool, slot) && GetEntityHandle(pool, slot) == handle);
 }
 
-void AddBloodSplatter(Particle* particles, Color color, Vector2 bulletVel, Vector2 bulletPos, int zombieSize) {
-    
-    int bloodCount = 4;
-    float velChangeMax = 300;
-    float rotation = 0;
-    int shape = 0;
-    int size = zombieSize/10;
-    double bloodLifeTime = 2;
-    double LifeTimeDiffMax = 0.5;
-    int moveType = 1;
+int GetProcessorCount() {
+#if defined(_WIN32)
+    Win32SystemInfo info;
+    GetSystemInfo(&info);
     
-    CreateParticles(particles, bulletPos, bulletVel, velChangeMax, shape, color, size, bloodCount, rotation, bloodLifeTime, LifeTimeDiffMax, moveType);
+    if (info.numberOfProcessors > 0) {
+        return (int)info.numberOfProcessors;
+    }
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
     
+    if (count > 0) {
+        return (int)count;
+    }
+#endif
+    return 4;
 }
 
-void GenerateDetail(MapDetail* mapDetails, int currentDetail) {
-    int spawnX = GenerateRandInt(mapWidth) - mapWidth/2;
-    int spawnY = GenerateRandInt(mapHeight) - mapHeight/2;
-    int type = GenerateRandInt(environmentDetailTypes);
-    
-    mapDetails[currentDetail].pos.x = spawnX;
-    mapDetails[currentDetail].pos.y = spawnY;
-    mapDetails[currentDetail].type = type;
+long long PackRange(int start, int end) {
+    return (((long long)start << 32) | (unsigned int)end);
 }
 
-void DrawAllDetail (MapDetail* mapDetails, int detailRandomizer, Vector2 playerPos, Vector2 playerScreenPos) {
+//Returns false when the deque is full, the caller then runs the range itself
+bool PushRange(WorkDeque* deque, int start, int end) {
     
-    for (int i = 0; i < environmentDetailLimit; i++) {
-        
-        if (mapDetails[i].type == 0) { //Grass
-            float size = i*detailRandomizer % 100/10 + 1;
-            
-            DrawCircle(GetPos(playerPos.x, playerScreenPos.x, mapDetails[i].pos.x), GetPos(playerPos.y, playerScreenPos.y, mapDetails[i].pos.y), size, DARKGREEN);
-            
-        } else if (mapDetails[i].type == 1) { //Rock
-            float size = i*detailRandomizer % 200/10 + 10;
-            int rotation = i*detailRandomizer % 359;
-            int sides = i*detailRandomizer % 7;
-             
-            Vector2 center = {GetPos(playerPos.x, playerScreenPos.x, mapDetails[i].pos.x), GetPos(playerPos.y, playerScreenPos.y, mapDetails[i].pos.y)};
-            
-            DrawPoly(center, sides, size, rotation, GRAY);
-
-        }
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    
+    if (bottom - top >= jobDequeCapacity) {
+        return false;
     }
+    
+    atomic_store_explicit(&deque->ranges[bottom % jobDequeCapacity], PackRange(start, end), memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    
+    return true;
 }
 
-void DamageZombie (Bullet* bullets, int currentBullet, int hitZombieIndex, Zombie* zombies, Vector2 defaultZombiePos, Vector2 defaultBulletPos, Particle* particles, ZombieType* zombieTypes) {
+long long PopRange(WorkDeque* deque) {
     
-    zombies[hitZombieIndex].currentHealth -= bullets[currentBullet].damage;
-    bullets[currentBullet].targetsLeft --;
-    Vector2 bulletVel = {bullets[currentBullet].xVel/2, bullets[currentBullet].yVel/2};
-    AddBloodSplatter(particles, zombieTypes[zombies[hitZombieIndex].type].color, bulletVel, zombies[hitZombieIndex].pos,  zombieTypes[zombies[hitZombieIndex].type].size);
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
     
-    if (zombies[hitZombieIndex].currentHealth <= 0) {
-        Vector2 zero = {0, 0};
-        AddBloodExplosion(particles, zombieTypes[zombies[hitZombieIndex].type].color, zero, zombies[hitZombieIndex].pos,  zombieTypes[zombies[hitZombieIndex].type].size); 
-        AddExperienceExplosion(particles, zombieTypes[zombies[hitZombieIndex].type].color, zero, zombies[hitZombieIndex].pos,  zombieTypes[zombies[hitZombieIndex].type].expCount); 
-        ResetZombie(zombies, hitZombieIndex, defaultZombiePos);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return emptyRange;
     }
-    if (bullets[currentBullet].targetsLeft <= 0) {
-        ResetBullet(bullets, currentBullet, defaultBulletPos);
+    
+    long long range = atomic_load_explicit(&deque->ranges[bottom % jobDequeCapacity], memory_order_relaxed);
+    
+    //Last range left, race the thieves for it
+    if (top == bottom) {
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            range = emptyRange;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
     }
     
+    return range;
 }
 
-void AddColision(Bullet* bullets, int currentBullet, int collisionID, Zombie* zombies, Vector2 defaultZombiePos, Vector2 defaultBulletPos, ZombieType* zombieTypes, Particle* particles) {
+long long StealRange(WorkDeque* deque) {
     
-    int collisionArrayLength = sizeof(bullets[0].zHitIndexes) / sizeof(bullets[0].zHitIndexes[0]);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
     
-    for(int i = 0; i < collisionArrayLength; i++) {
-
-        if (bullets[currentBullet].zHitIndexes[i] == collisionID) {
-            return;
-        } else if (bullets[currentBullet].zHitIndexes[i] == -1) {
-            
-            bullets[currentBullet].zHitIndexes[i] = collisionID;
-            DamageZombie (bullets, currentBullet, collisionID, zombies, defaultZombiePos, defaultBulletPos, particles, zombieTypes);
-            return;
-        }
-        
+    if (top >= bottom) {
+        return emptyRange;
     }
     
+    long long range = atomic_load_explicit(&deque->ranges[top % jobDequeCapacity], memory_order_relaxed);
+    
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return emptyRange;
+    }
+    
+    return range;
 }
 
-void CheckHitsAll(Bullet* bullets, int currentBullet, Zombie* zombies, ZombieType* zombieTypes, Vector2 defaultZombiePos, Vector2 defaultBulletPos, Particle* particles) {
+//Runs ranges of the current parallel for until all of it is done, stealing when the own deque is empty
+void WorkOnParallelFor(JobSystem* jobs, int worker) {
     
-
-    for (int i = 0; i < maxZombieCount; i++) {
+    unsigned int victimSeed = worker * 2654435761u + 1;
+    
+    while (atomic_load(&jobs->remaining) > 0) {
+        
+        long long range = PopRange(&jobs->deques[worker]);
+        
+        for (int attempt = 0; range == emptyRange && attempt < jobs->workerCount; attempt++) {
+            
+            //xorshift, rand() is left alone so the game stays reproducible
+            victimSeed ^= victimSeed << 13;
+            victimSeed ^= victimSeed >> 17;
+            victimSeed ^= victimSeed << 5;
+            
+            int victim = victimSeed % jobs->workerCount;
+            
+            if (victim != worker) {
+                range = StealRange(&jobs->deques[victim]);
+            }
+        }
         
-        if (!Vector2Compare(zombies[i].pos, defaultZombiePos)) {
+        if (range == emptyRange) {
+            sched_yield();
+            continue;
+        }
+        
+        int start = (int)(range >> 32);
+        int end = (int)(range & 0xffffffff);
+        
+        //Big ranges are halved, the upper halves wait in the deque for idle workers to steal
+        while (end - start > jobs->grainSize) {
             
-            int collisionID = CollisionCheckBullet(bullets[currentBullet].pos, zombies, zombieTypes, i);
+            int middle = start + (end - start)/2;
             
-            if (collisionID != -1) {
-                AddColision(bullets, currentBullet, collisionID, zombies, defaultZombiePos, defaultBulletPos, zombieTypes, particles);
+            if (!PushRange(&jobs->deques[worker], middle, end)) {
+                break;
             }
             
+            end = middle;
         }
         
+        jobs->function(jobs->data, start, end, worker);
+        atomic_fetch_sub(&jobs->remaining, end - start);
     }
     
 }
 
-void ShowDeathScreen() {    
-    DrawRectangle(screenWidth/2 - 100 ,screenHeight/2 - 12, 200, 50, RAYWHITE);
-    DrawText("YOU DIED", screenWidth/2 - 75 ,screenHeight/2, 30, BLACK);    
+void* WorkerThread(void* argument) {
+    
+    WorkerThreadArgs* args = argument;
+    JobSystem* jobs = args->jobs;
+    int seenGeneration = 0;
+    
+    while (true) {
+        
+        pthread_mutex_lock(&jobs->mutex);
+        
+        while (jobs->running && jobs->generation == seenGeneration) {
+            pthread_cond_wait(&jobs->wake, &jobs->mutex);
+        }
+        
+        if (!jobs->running) {
+            pthread_mutex_unlock(&jobs->mutex);
+            break;
+        }
+        
+        seenGeneration = jobs->generation;
+        pthread_mutex_unlock(&jobs->mutex);
+        
+        WorkOnParallelFor(jobs, args->worker);
+    }
+    
+    return NULL;
 }
 
-void DrawPlayerHealthBar(double playerHealth, Vector2 playerScreenPos) {
+void InitJobSystem(JobSystem* jobs, int workerCount) {
     
-    int healthBarWidth = 120;
-    int healthBarHeight = 15;
-    int healthBarMargin = 30;
-    int healthBarBorder = 6; 
-    Color remainingHealthColor = GREEN;
-    Color baseColor = RED;
+    if (workerCount < 1) {
+        workerCount = 1;
+    } else if (workerCount > maxWorkerCount) {
+        workerCount = maxWorkerCount;
+    }
+    
+    jobs->workerCount = workerCount;
+    jobs->deques = malloc(workerCount * sizeof(WorkDeque));
+    jobs->threads = malloc(workerCount * sizeof(pthread_t));
+    jobs->threadArgs = malloc(workerCount * sizeof(WorkerThreadArgs));
     
-    double remainingHealthWidth = healthBarWidth * (playerHealth/playerMaxHealth);
+    for (int i = 0; i < workerCount; i++) {
+        atomic_init(&jobs->deques[i].top, 0);
+        atomic_init(&jobs->deques[i].bottom, 0);
+        jobs->deques[i].ranges = malloc(jobDequeCapacity * sizeof(atomic_llong));
+    }
     
-    DrawRectangle(playerScreenPos.x - healthBarWidth/2 - healthBarBorder/2, playerScreenPos.y + healthBarHeight + healthBarMargin - healthBarBorder/2, healthBarWidth + healthBarBorder, healthBarHeight + healthBarBorder, BLACK);
-    DrawRectangle(playerScreenPos.x - healthBarWidth/2, playerScreenPos.y + healthBarHeight + healthBarMargin, healthBarWidth, healthBarHeight, baseColor);
-    DrawRectangle(playerScreenPos.x - healthBarWidth/2, playerScreenPos.y + healthBarHeight + healthBarMargin, remainingHealthWidth, healthBarHeight, remainingHealthColor);
+    jobs->function = NULL;
+    jobs->data = NULL;
+    jobs->grainSize = 1;
+    atomic_init(&jobs->remaining, 0);
+    
+    pthread_mutex_init(&jobs->mutex, NULL);
+    pthread_cond_init(&jobs->wake, NULL);
+    jobs->generation = 0;
+    jobs->running = true;
+    
+    //Worker 0 is the calling thread
+    for (int i = 1; i < workerCount; i++) {
+        jobs->threadArgs[i].jobs = jobs;
+        jobs->threadArgs[i].worker = i;
+        pthread_create(&jobs->threads[i], NULL, WorkerThread, &jobs->threadArgs[i]);
+    }
     
+}
 
+void FreeJobSystem(JobSystem* jobs) {
+    
+    pthread_mutex_lock(&jobs->mutex);
+    jobs->running = false;
+    pthread_cond_broadcast(&jobs->wake);
+    pthread_mutex_unlock(&jobs->mutex);
+    
+    for (int i = 1; i < jobs->workerCount; i++) {
+        pthread_join(jobs->threads[i], NULL);
+    }
+    
+    for (int i = 0; i < jobs->workerCount; i++) {
+        free(jobs->deques[i].ranges);
+    }
+    
+    free(jobs->deques);
+    free(jobs->threads);
+    free(jobs->threadArgs);
+    pthread_mutex_destroy(&jobs->mutex);
+    pthread_cond_destroy(&jobs->wake);
+    
 }
 
-void DrawPlayerExpBar(double currentPlayerExp, double neededPlayerExp, int playerLevel) {
+//Calls function over [0, count) split across all workers and returns when every index is done, runs inline without a job system
+void ParallelFor(JobSystem* jobs, int count, int grainSize, ParallelForFunction function, void* data) {
     
-    int expBarBorder = 6; 
-    int expBarWidth = screenWidth-expBarBorder*2;
-    Vector2 expBarPos = {expBarBorder, expBarBorder};
-    int expBarHeight = 16;
-    int lvlTextSize = 15;
+    if (jobs == NULL || jobs->workerCount == 1 || count <= grainSize) {
+        if (count > 0) {
+            function(data, 0, count, 0);
+        }
+        return;
+    }
+    
+    jobs->function = function;
+    jobs->data = data;
+    jobs->grainSize = grainSize;
+    atomic_store(&jobs->remaining, count);
+    
+    PushRange(&jobs->deques[0], 0, count);
+    
+    pthread_mutex_lock(&jobs->mutex);
+    jobs->generation++;
+    pthread_cond_broadcast(&jobs->wake);
+    pthread_mutex_unlock(&jobs->mutex);
+    
+    WorkOnParallelFor(jobs, 0);
+    
+}
 
-    Color remainingExpColor = GOLD;
-    Color baseColor = GRAY;
+int RoundUpToZombieLanes(int count) {
+    return ((count + zombieLanes - 1) / zombieLanes) * zombieLanes;
+}
+
+bool GrowZombieStore(ZombieStore* zombies, int capacity) {
     
-    double remainingExpWidth = expBarWidth * (currentPlayerExp/neededPlayerExp);
+    //Padding lanes have zero speed so the movement kernels can run past the last zombie
+    capacity = RoundUpToZombieLanes(capacity);
+    int oldCapacity = zombies->capacity;
+    
+    if (capacity <= oldCapacity) {
+        return(true);
+    }
     
-    DrawRectangle(expBarPos.x - expBarBorder/2, expBarPos.y - expBarBorder/2, expBarWidth + expBarBorder, expBarHeight + expBarBorder, BLACK);
-    DrawRectangle(expBarPos.x, expBarPos.y, expBarWidth, expBarHeight, baseColor);
-    DrawRectangle(expBarPos.x, expBarPos.y, remainingExpWidth, expBarHeight, remainingExpColor);
+    bool committed = capacity <= zombies->maxCapacity;
     
-    char level[BUFSIZ];
+    void* floatArrays[12] = {zombies->x, zombies->y, zombies->prevX, zombies->prevY, zombies->speed, zombies->size, zombies->health, zombies->xChange, zombies->yChange, zombies->xSeparation, zombies->ySeparation, zombies->pendingDamage};
+    for (int i = 0; i < 12 && committed; i++) {
+        committed = CommitEntityArray(floatArrays[i], sizeof(float), oldCapacity, capacity);
+    }
     
-    sprintf(level, "%d", playerLevel);
+    committed = committed && CommitEntityArray(zombies->lastAttackTime, sizeof(double), oldCapacity, capacity);
+    committed = committed && CommitEntityArray(zombies->type, sizeof(int), oldCapacity, capacity);
     
-    DrawText("Lvl.", screenWidth - 45 , expBarPos.y + expBarHeight/2 - lvlTextSize/2, lvlTextSize, BLACK);    
-    DrawText(level, screenWidth - 20, expBarPos.y + expBarHeight/2 - lvlTextSize/2, lvlTextSize, BLACK);
+    if (committed) {
+        zombies->capacity = capacity;
+    }
     
+    return(committed);
+}
+
+void InitZombieStore(ZombieStore* zombies, EntityArena* arena, int capacity, int maxCapacity) {
+    
+    maxCapacity = RoundUpToZombieLanes(maxCapacity);
+    zombies->capacity = 0;
+    zombies->maxCapacity = maxCapacity;
+    
+    zombies->x = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->y = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->prevX = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->prevY = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->speed = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->size = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->health = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->xChange = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->yChange = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->xSeparation = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->ySeparation = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->lastAttackTime = ReserveEntityArray(arena, sizeof(double), maxCapacity, 0);
+    zombies->pendingDamage = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    zombies->type = ReserveEntityArray(arena, sizeof(int), maxCapacity, 0);
+    
+    GrowZombieStore(zombies, (capacity < maxCapacity) ? capacity : maxCapacity);
     
 }
 
-bool ArrayContainsNumber(int arr[], int length, int number) {
-    for (int i = 0; i < length; i++) {
-        if (arr[i] == number) {
-            return true;
+//Returns a free zombie slot, the store and pool grow by a chunk when every slot is taken. -1 once the maximum is reached.
+int AllocateZombie(ZombieStore* zombies, EntityPool* zombiePool) {
+    
+    if (zombiePool->freeCount == 0) {
+        
+        int capacity = GetGrownCapacity(zombiePool->capacity, zombiePool->maxCapacity, zombieChunkSize);
+        
+        if (capacity == 0 || !GrowZombieStore(zombies, capacity) || !GrowEntityPool(zombiePool, capacity)) {
+            return(-1);
         }
     }
-    return false;
+    
+    return(AllocateEntity(zombiePool));
 }
 
-int GetUpgrade(int* currentUpgrades, int* gunsRollTickets, int upgradesCount) {
-    
-    int totalStatsForWeapons = 7; 
+Vector2 GetZombiePos(ZombieStore* zombies, int zombieIndex) {
+    Vector2 pos = {zombies->x[zombieIndex], zombies->y[zombieIndex]};
+    return pos;
+}
 
-    int totalTickets = 0; 
-    for (int i = 0; i < totalStatsForWeapons; i++) {
-        totalTickets += gunsRollTickets[i];
+int ChooseZombieType (ZombieType* zombieTypes, int wave) {
+    
+    int totalSpawnTickets = 0;
+    
+    for (int i = 0; i < zombieTypesCount; i++) {
+        if (zombieTypes[i].firstSpawnWave <= wave) {
+            totalSpawnTickets += zombieTypes[i].spawnTicketsCount;
+        }
     }
     
-    while(true) {
+    int spawnNum = GenerateRandInt(totalSpawnTickets);
+    
+    for (int i = 0; i < zombieTypesCount; i++) {
         
-        int upgradeNum = GenerateRandInt(totalTickets);
+        spawnNum -= zombieTypes[i].spawnTicketsCount;
         
-        for (int i = 0; i < totalStatsForWeapons; i++) {
-            
-            upgradeNum -= gunsRollTickets[i];
-            
-            if (upgradeNum <= 0 && !ArrayContainsNumber(currentUpgrades, upgradesCount, i)) {
-                
-                return(i);
-                
-            }
-            
+        if (spawnNum <= 0) {
+            return i;
         }
         
     }
     
+    return 0;
 }
 
-int* GetPlayerUpgrades(int upgradesCount, int* gunsRollTickets) {
+double SpawnZombie(ZombieStore* zombies, EntityPool* zombiePool, ZombieType* zombieTypes, int wave, double lastZombieSpawnTime, double currentTime) {
     
-    int *chosenUpgrades = (int*)malloc(upgradesCount * sizeof(int));
+    int i = AllocateZombie(zombies, zombiePool);
     
-    for (int i = 0; i < upgradesCount; i++) {
-       
-        chosenUpgrades[i] = GetUpgrade(chosenUpgrades, gunsRollTickets, upgradesCount);
-        printf("GetUpgrades: %d\n", chosenUpgrades[i]);   
+    if (i != -1) {
+        
+        int type = ChooseZombieType(zombieTypes, wave);
+        zombies->type[i] = type;
+        zombies->health[i] = zombieTypes[type].health;
+        zombies->speed[i] = zombieTypes[type].speed;
+        zombies->size[i] = zombieTypes[type].size;
+        
+        int spawnPos = ((rand() % 4)); //4 becuase map has 4 walls that zombies can spawn at.
+        int spawnWidth = (rand() % mapWidth)-mapWidth/2;
+        int spawnHeight = (rand() % mapHeight)-mapHeight/2;
+        
+        if (spawnPos == 0) { //Top (-y)
+            zombies->x[i] = spawnWidth;
+            zombies->y[i] = -mapHeight/2-100;
+        } else if (spawnPos == 1) { //Right (+x)
+            zombies->x[i] = mapWidth/2+100;
+            zombies->y[i] = spawnHeight;
+        } else if (spawnPos == 2) { //Left (-x)
+            zombies->x[i] = -mapWidth/2-100;
+            zombies->y[i] = spawnHeight;
+        } else { //Bottom (+y)
+            zombies->x[i] = spawnWidth;
+            zombies->y[i] = mapHeight/2+100;
+        }
+        
+        zombies->prevX[i] = zombies->x[i];
+        zombies->prevY[i] = zombies->y[i];
+        zombies->xChange[i] = 0.0f;
+        zombies->yChange[i] = 0.0f;
+        zombies->xSeparation[i] = 0.0f;
+        zombies->ySeparation[i] = 0.0f;
+        zombies->lastAttackTime[i] = 0.0;
+        
+        return (currentTime);
+        
     }
     
-    return(chosenUpgrades);
-    
+    return (lastZombieSpawnTime);
 }
 
-Rectangle GetUpgradeRectangle(int i, int upgradesCount) {
+double CreateZombie(ZombieStore* zombies, EntityPool* zombiePool, ZombieType* zombieTypes, int wave, double lastZombieSpawnTime, double currentTime) {
     
-    int width = 300;
-    int height = 450;
-
-    Vector2 pos;
+    if (zombieSpawnDelay + lastZombieSpawnTime <= currentTime) {
+        lastZombieSpawnTime = SpawnZombie(zombies, zombiePool, zombieTypes, wave, lastZombieSpawnTime, currentTime);
+    }
     
-    pos.x = (screenWidth/upgradesCount * i + (width/upgradesCount)/2);
-    pos.y = (screenHeight/2 - height/2);
+    return(lastZombieSpawnTime);    
+}
     
-    Rectangle rec = {pos.x, pos.y, width, height};
     
-    return rec;
+
+
+double CalcCos(float v, double distance) {
+    float vRadians = v * PI / 180.0;
     
+    return(cos(vRadians)*distance);
 }
 
-void WriteUpgradeDetails(Rectangle rec, int chosenUpgrade) {
+double CalcSin(float v, double distance) {
+    float vRadians = v * PI / 180.0;
     
-    int fontSize = 30;
+    return(sin(vRadians)*distance);
+}
+
+double GetDistance(Vector2 a, Vector2 b) {
+    float xDist = a.x - b.x;
+    float yDist = a.y - b.y;
     
-    char upgradeNum[BUFSIZ];
-    sprintf(upgradeNum, "%d", chosenUpgrade);
+    return (sqrt(pow(xDist, 2) + pow(yDist, 2)));
+}
+
+
+int CheckPlayerHealth (double* playerHealth) {
     
-    DrawText(upgradeNum, rec.x + 3, rec.y, fontSize, BLACK);
-    DrawText(upgradeNum, rec.x + rec.width - fontSize/2 - 3, rec.y + rec.height - fontSize + 2, fontSize, BLACK);
+    if (*playerHealth <= 0) {
+        return(1);
+    }
     
-    if (chosenUpgrade == 0) {
+    return(0);
+}
+
+
+void DamagePlayer (double* playerHealth, double damage) {
+
+    *playerHealth -= damage;
+    
+}
+
+
+//Only writes the zombie's own pendingDamage so it can run in parallel, the damage is added up afterwards
+void ZombieAttackCheck(ZombieStore* zombies, int currentZombie, Vector2 playerPos, ZombieType* zombieTypes, double currentTime) {
+    
+    zombies->pendingDamage[currentZombie] = 0;
+    
+    if (currentTime > zombies->lastAttackTime[currentZombie] + zombieTypes[zombies->type[currentZombie]].attackDelay) {
+        
+        float reach = zombies->size[currentZombie];
+        
+        if (V2DistanceSqr(GetZombiePos(zombies, currentZombie), playerPos) < reach*reach) {
+            
+            zombies->lastAttackTime[currentZombie] = currentTime;
+            zombies->pendingDamage[currentZombie] = zombieTypes[zombies->type[currentZombie]].damage;
+            
+        }
+        
+    }
+    
+}
+
+
+
+
+void InitZombieGrid(ZombieGrid* zombieGrid, EntityArena* arena, int zombieCapacity) {
+    
+    zombieGrid->columns = (mapWidth + zGridMargin*2) / zGridCellSize;
+    zombieGrid->rows = (mapHeight + zGridMargin*2) / zGridCellSize;
+    zombieGrid->originX = -mapWidth/2 - zGridMargin;
+    zombieGrid->originY = -mapHeight/2 - zGridMargin;
+    
+    zombieGrid->cellStart = malloc((zombieGrid->columns * zombieGrid->rows + 1) * sizeof(int));
+    zombieGrid->cellZombies = ReserveEntityArray(arena, sizeof(int), zombieCapacity, zombieCapacity);
+    zombieGrid->zombieCell = ReserveEntityArray(arena, sizeof(int), zombieCapacity, zombieCapacity);
+    
+}
+
+int GetGridColumn(ZombieGrid* zombieGrid, float x) {
+    
+    int column = (int)floorf((x - zombieGrid->originX) / zGridCellSize);
+    
+    //Zombies outside the grid are kept in the edge cells
+    if (column < 0) {
+        return 0;
+    } else if (column >= zombieGrid->columns) {
+        return zombieGrid->columns - 1;
+    }
+    
+    return column;
+}
+
+int GetGridRow(ZombieGrid* zombieGrid, float y) {
+    
+    int row = (int)floorf((y - zombieGrid->originY) / zGridCellSize);
+    
+    if (row < 0) {
+        return 0;
+    } else if (row >= zombieGrid->rows) {
+        return zombieGrid->rows - 1;
+    }
+    
+    return row;
+}
+
+//Counting sort of all live zombies into their cells
+void BuildZombieGrid(ZombieGrid* zombieGrid, ZombieStore* zombies, EntityPool* zombiePool) {
+    PROFILE_SCOPE("BuildZombieGrid");
+    
+    int cellCount = zombieGrid->columns * zombieGrid->rows;
+    
+    for (int i = 0; i <= cellCount; i++) {
+        zombieGrid->cellStart[i] = 0;
+    }
+    
+    for (int n = 0; n < zombiePool->activeCount; n++) {
+        
+        int i = zombiePool->activeSlots[n];
+        int cell = GetGridRow(zombieGrid, zombies->y[i]) * zombieGrid->columns + GetGridColumn(zombieGrid, zombies->x[i]);
+        zombieGrid->zombieCell[i] = cell;
+        zombieGrid->cellStart[cell + 1]++;
+    }
+    
+    for (int i = 0; i < cellCount; i++) {
+        zombieGrid->cellStart[i + 1] += zombieGrid->cellStart[i];
+    }
+    
+    //cellStart[cell] is used as a write cursor and shifted back afterwards
+    for (int n = 0; n < zombiePool->activeCount; n++) {
+        
+        int i = zombiePool->activeSlots[n];
+        int cell = zombieGrid->zombieCell[i];
+        
+        zombieGrid->cellZombies[zombieGrid->cellStart[cell]] = i;
+        zombieGrid->cellStart[cell]++;
+    }
+    
+    for (int i = cellCount; i > 0; i--) {
+        zombieGrid->cellStart[i] = zombieGrid->cellStart[i - 1];
+    }
+    zombieGrid->cellStart[0] = 0;
+    
+}
+
+//Returns the number of zombies written to results, every zombie in a cell touching the rectangle is included
+int QueryZombieGridRect(ZombieGrid* zombieGrid, float minX, float minY, float maxX, float maxY, int* results) {
+    
+    int minColumn = GetGridColumn(zombieGrid, minX);
+    int maxColumn = GetGridColumn(zombieGrid, maxX);
+    int minRow = GetGridRow(zombieGrid, minY);
+    int maxRow = GetGridRow(zombieGrid, maxY);
+    
+    int resultCount = 0;
+    
+    for (int row = minRow; row <= maxRow; row++) {
+        for (int column = minColumn; column <= maxColumn; column++) {
+            
+            int cell = row * zombieGrid->columns + column;
+            
+            for (int i = zombieGrid->cellStart[cell]; i < zombieGrid->cellStart[cell + 1]; i++) {
+                results[resultCount] = zombieGrid->cellZombies[i];
+                resultCount++;
+            }
+        }
+    }
+    
+    return resultCount;
+}
+
+//Same as QueryZombieGridRect for the square around pos
+int QueryZombieGrid(ZombieGrid* zombieGrid, Vector2 pos, float radius, int* results) {
+    return QueryZombieGridRect(zombieGrid, pos.x - radius, pos.y - radius, pos.x + radius, pos.y + radius, results);
+}
+
+//Four straight neighbours first, so straight steps win ties against diagonal ones
+const int flowStepColumns[8] = {1, -1, 0, 0, 1, 1, -1, -1};
+const int flowStepRows[8] = {0, 0, 1, -1, 1, -1, 1, -1};
+
+void InitFlowField(FlowField* flowField) {
+    
+    flowField->columns = (mapWidth + zGridMargin*2) / flowCellSize;
+    flowField->rows = (mapHeight + zGridMargin*2) / flowCellSize;
+    flowField->originX = -mapWidth/2 - zGridMargin;
+    flowField->originY = -mapHeight/2 - zGridMargin;
+    flowField->targetCell = -1;
+    flowField->blockedCount = 0;
+    
+    int cellCount = flowField->columns * flowField->rows;
+    flowField->blocked = calloc(cellCount, sizeof(unsigned char));
+    flowField->lineOfSight = malloc(cellCount * sizeof(unsigned char));
+    flowField->distance = malloc(cellCount * sizeof(int));
+    flowField->dirX = malloc(cellCount * sizeof(float));
+    flowField->dirY = malloc(cellCount * sizeof(float));
+    flowField->queue = malloc(cellCount * sizeof(int));
+    
+}
+
+void FreeFlowField(FlowField* flowField) {
+    free(flowField->blocked);
+    free(flowField->lineOfSight);
+    free(flowField->distance);
+    free(flowField->dirX);
+    free(flowField->dirY);
+    free(flowField->queue);
+}
+
+int GetFlowCell(FlowField* flowField, Vector2 pos) {
+    
+    int column = (int)floorf((pos.x - flowField->originX) / flowCellSize);
+    int row = (int)floorf((pos.y - flowField->originY) / flowCellSize);
+    
+    //Anything outside the field uses the edge cells
+    if (column < 0) {
+        column = 0;
+    } else if (column >= flowField->columns) {
+        column = flowField->columns - 1;
+    }
+    
+    if (row < 0) {
+        row = 0;
+    } else if (row >= flowField->rows) {
+        row = flowField->rows - 1;
+    }
+    
+    return row * flowField->columns + column;
+}
+
+bool IsFlowCellOpen(FlowField* flowField, int column, int row) {
+    
+    if (column < 0 || column >= flowField->columns || row < 0 || row >= flowField->rows) {
+        return false;
+    }
+    
+    return flowField->blocked[row * flowField->columns + column] == 0;
+}
+
+//Diagonal steps may not cut past the corner of a blocked cell
+bool CanFlowStep(FlowField* flowField, int column, int row, int step) {
+    
+    int nextColumn = column + flowStepColumns[step];
+    int nextRow = row + flowStepRows[step];
+    
+    if (!IsFlowCellOpen(flowField, nextColumn, nextRow)) {
+        return false;
+    }
+    
+    if (flowStepColumns[step] != 0 && flowStepRows[step] != 0) {
+        return IsFlowCellOpen(flowField, nextColumn, row) && IsFlowCellOpen(flowField, column, nextRow);
+    }
+    
+    return true;
+}
+
+//Marks every cell touching area, the field is rebuilt on the next BuildFlowField
+void SetFlowFieldBlocked(FlowField* flowField, Rectangle area, bool blocked) {
+    
+    int minCell = GetFlowCell(flowField, (Vector2){area.x, area.y});
+    int maxCell = GetFlowCell(flowField, (Vector2){area.x + area.width, area.y + area.height});
+    
+    for (int row = minCell / flowField->columns; row <= maxCell / flowField->columns; row++) {
+        for (int column = minCell % flowField->columns; column <= maxCell % flowField->columns; column++) {
+            
+            int cell = row * flowField->columns + column;
+            
+            if (flowField->blocked[cell] != blocked) {
+                flowField->blocked[cell] = blocked;
+                flowField->blockedCount += blocked ? 1 : -1;
+            }
+        }
+    }
+    
+    flowField->targetCell = -1;
+    
+}
+
+//Walks the cells on the line between the two cells, the same corner rule as CanFlowStep applies
+bool HasFlowLineOfSight(FlowField* flowField, int fromCell, int toCell) {
+    
+    int column = fromCell % flowField->columns;
+    int row = fromCell / flowField->columns;
+    int endColumn = toCell % flowField->columns;
+    int endRow = toCell / flowField->columns;
+    
+    int columnDist = abs(endColumn - column);
+    int rowDist = -abs(endRow - row);
+    int columnStep = (column < endColumn) ? 1 : -1;
+    int rowStep = (row < endRow) ? 1 : -1;
+    int error = columnDist + rowDist;
+    
+    while (column != endColumn || row != endRow) {
+        
+        int doubleError = error * 2;
+        bool moveColumn = (doubleError >= rowDist);
+        bool moveRow = (doubleError <= columnDist);
+        
+        if (moveColumn && moveRow && (!IsFlowCellOpen(flowField, column + columnStep, row) || !IsFlowCellOpen(flowField, column, row + rowStep))) {
+            return false;
+        }
+        
+        if (moveColumn) {
+            error += rowDist;
+            column += columnStep;
+        }
+        if (moveRow) {
+            error += columnDist;
+            row += rowStep;
+        }
+        
+        if (!IsFlowCellOpen(flowField, column, row)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+//Breadth first search out from the player's cell, then every cell points at its neighbour closest to the player.
+//Does nothing while the player stays in the same cell.
+void BuildFlowField(FlowField* flowField, Vector2 playerPos) {
+    
+    int targetCell = GetFlowCell(flowField, playerPos);
+    
+    if (targetCell == flowField->targetCell) {
+        return;
+    }
+    
+    PROFILE_SCOPE("BuildFlowField");
+    
+    flowField->targetCell = targetCell;
+    int cellCount = flowField->columns * flowField->rows;
+    
+    for (int i = 0; i < cellCount; i++) {
+        flowField->distance[i] = -1;
+    }
+    
+    flowField->distance[targetCell] = 0;
+    flowField->queue[0] = targetCell;
+    int queueStart = 0;
+    int queueEnd = 1;
+    
+    while (queueStart < queueEnd) {
+        
+        int cell = flowField->queue[queueStart];
+        queueStart++;
+        int column = cell % flowField->columns;
+        int row = cell / flowField->columns;
+        
+        for (int step = 0; step < 8; step++) {
+            
+            int nextCell = (row + flowStepRows[step]) * flowField->columns + column + flowStepColumns[step];
+            
+            if (CanFlowStep(flowField, column, row, step) && flowField->distance[nextCell] < 0) {
+                flowField->distance[nextCell] = flowField->distance[cell] + 1;
+                flowField->queue[queueEnd] = nextCell;
+                queueEnd++;
+            }
+        }
+    }
+    
+    for (int cell = 0; cell < cellCount; cell++) {
+        
+        int column = cell % flowField->columns;
+        int row = cell / flowField->columns;
+        int bestDistance = flowField->distance[cell];
+        Vector2 direction = {0, 0};
+        
+        for (int step = 0; step < 8 && bestDistance > 0; step++) {
+            
+            int nextCell = (row + flowStepRows[step]) * flowField->columns + column + flowStepColumns[step];
+            
+            if (CanFlowStep(flowField, column, row, step) && flowField->distance[nextCell] >= 0 && flowField->distance[nextCell] < bestDistance) {
+                bestDistance = flowField->distance[nextCell];
+                direction.x = -flowStepColumns[step];
+                direction.y = -flowStepRows[step];
+            }
+        }
+        
+        direction = V2Normalize(direction);
+        flowField->dirX[cell] = direction.x;
+        flowField->dirY[cell] = direction.y;
+        
+        //Zombies that can see the player (or can't reach it at all) keep walking straight at it
+        if (flowField->blockedCount == 0 || flowField->distance[cell] <= 0) {
+            flowField->lineOfSight[cell] = 1;
+        } else {
+            flowField->lineOfSight[cell] = HasFlowLineOfSight(flowField, cell, targetCell);
+        }
+    }
+    
+}
+
+//One lookup per zombie, replaces the straight seek with the field's direction when the player is out of sight
+void ApplyFlowField(ZombieStore* zombies, int zombieIndex, FlowField* flowField) {
+    
+    int cell = GetFlowCell(flowField, GetZombiePos(zombies, zombieIndex));
+    
+    if (flowField->lineOfSight[cell] == 0) {
+        zombies->xChange[zombieIndex] = flowField->dirX[cell] * zombies->speed[zombieIndex];
+        zombies->yChange[zombieIndex] = flowField->dirY[cell] * zombies->speed[zombieIndex];
+    }
+    
+}
+
+
+//Seek and integrate kernels, 8 zombies per iteration with AVX2, two 4 wide halves with SSE2 or a plain loop otherwise
+void SeekPlayerKernel(ZombieStore* zombies, int count, Vector2 playerPos) {
+    
+    for (int i = 0; i < count; i += zombieLanes) {
+        
+#if defined(__AVX2__)
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(zombies->x + i), _mm256_set1_ps(playerPos.x));
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(zombies->y + i), _mm256_set1_ps(playerPos.y));
+        __m256 speed = _mm256_loadu_ps(zombies->speed + i);
+        __m256 lengthSqr = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 scale = _mm256_div_ps(speed, _mm256_sqrt_ps(lengthSqr));
+        
+        //A zombie standing on the player walks along +x, like atan2(0, 0) did
+        __m256 hasLength = _mm256_cmp_ps(lengthSqr, _mm256_setzero_ps(), _CMP_GT_OQ);
+        _mm256_storeu_ps(zombies->xChange + i, _mm256_blendv_ps(speed, _mm256_mul_ps(dx, scale), hasLength));
+        _mm256_storeu_ps(zombies->yChange + i, _mm256_and_ps(_mm256_mul_ps(dy, scale), hasLength));
+#elif defined(__SSE2__)
+        for (int half = i; half < i + zombieLanes; half += 4) {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(zombies->x + half), _mm_set1_ps(playerPos.x));
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(zombies->y + half), _mm_set1_ps(playerPos.y));
+            __m128 speed = _mm_loadu_ps(zombies->speed + half);
+            __m128 lengthSqr = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+            __m128 scale = _mm_div_ps(speed, _mm_sqrt_ps(lengthSqr));
+            
+            __m128 hasLength = _mm_cmpgt_ps(lengthSqr, _mm_setzero_ps());
+            __m128 xChange = _mm_or_ps(_mm_and_ps(hasLength, _mm_mul_ps(dx, scale)), _mm_andnot_ps(hasLength, speed));
+            _mm_storeu_ps(zombies->xChange + half, xChange);
+            _mm_storeu_ps(zombies->yChange + half, _mm_and_ps(_mm_mul_ps(dy, scale), hasLength));
+        }
+#else
+        for (int j = i; j < i + zombieLanes; j++) {
+            float dx = zombies->x[j] - playerPos.x;
+            float dy = zombies->y[j] - playerPos.y;
+            float length = sqrtf(dx*dx + dy*dy);
+            
+            if (length > 0) {
+                zombies->xChange[j] = dx * zombies->speed[j] / length;
+                zombies->yChange[j] = dy * zombies->speed[j] / length;
+            } else {
+                zombies->xChange[j] = zombies->speed[j];
+                zombies->yChange[j] = 0;
+            }
+        }
+#endif
+        
+    }
+    
+}
+
+void IntegrateZombiesKernel(ZombieStore* zombies, int count, float frameTime) {
+    
+    for (int i = 0; i < count; i += zombieLanes) {
+        
+#if defined(__AVX2__)
+        __m256 dt = _mm256_set1_ps(frameTime);
+        _mm256_storeu_ps(zombies->x + i, _mm256_sub_ps(_mm256_loadu_ps(zombies->x + i), _mm256_mul_ps(_mm256_loadu_ps(zombies->xChange + i), dt)));
+        _mm256_storeu_ps(zombies->y + i, _mm256_sub_ps(_mm256_loadu_ps(zombies->y + i), _mm256_mul_ps(_mm256_loadu_ps(zombies->yChange + i), dt)));
+#elif defined(__SSE2__)
+        __m128 dt = _mm_set1_ps(frameTime);
+        for (int half = i; half < i + zombieLanes; half += 4) {
+            _mm_storeu_ps(zombies->x + half, _mm_sub_ps(_mm_loadu_ps(zombies->x + half), _mm_mul_ps(_mm_loadu_ps(zombies->xChange + half), dt)));
+            _mm_storeu_ps(zombies->y + half, _mm_sub_ps(_mm_loadu_ps(zombies->y + half), _mm_mul_ps(_mm_loadu_ps(zombies->yChange + half), dt)));
+        }
+#else
+        for (int j = i; j < i + zombieLanes; j++) {
+            zombies->x[j] -= zombies->xChange[j] * frameTime;
+            zombies->y[j] -= zombies->yChange[j] * frameTime;
+        }
+#endif
+        
+    }
+    
+}
+
+void UpdateZombieSeparation(ZombieStore* zombies, int zombieIndex, ZombieGrid* zombieGrid, int* nearbyZombies) {
+    
+    float selfX = zombies->x[zombieIndex];
+    float selfY = zombies->y[zombieIndex];
+    float viewDistanceSqr = (float)zViewDistance * zViewDistance;
+    
+    float xSeparation = 0;
+    float ySeparation = 0;
+    
+    int nearbyCount = QueryZombieGrid(zombieGrid, GetZombiePos(zombies, zombieIndex), zViewDistance, nearbyZombies);
+    
+    for (int n = 0; n < nearbyCount; n++) {
+        
+        int i = nearbyZombies[n];
+        
+        float xDist = zombies->x[i] - selfX;
+        float yDist = zombies->y[i] - selfY;
+        float cDistSqr = xDist*xDist + yDist*yDist;
+        
+        //Zombies on the exact same spot (including itself) have no direction to separate in
+        if (cDistSqr < viewDistanceSqr && cDistSqr > 0) {
+            float cDist = sqrtf(cDistSqr);
+            xSeparation += xDist*zSeparation/cDist;
+            ySeparation += yDist*zSeparation/cDist;
+        }
+    }
+    
+    zombies->xSeparation[zombieIndex] = xSeparation;
+    zombies->ySeparation[zombieIndex] = ySeparation;
+    
+}
+
+//1, 2, 4 or 8 ticks between separation updates, by distance to the player
+int GetZombieUpdateInterval(ZombieStore* zombies, int zombieIndex, Vector2 playerPos) {
+    
+    float distanceSqr = V2DistanceSqr(GetZombiePos(zombies, zombieIndex), playerPos);
+    int interval = 1;
+    
+    for (int tier = 0; tier < 3; tier++) {
+        if (distanceSqr > aiTierDistances[tier] * aiTierDistances[tier]) {
+            interval *= 2;
+        }
+    }
+    
+    return(interval);
+}
+
+typedef struct ZombieJob {
+    ZombieStore* zombies;
+    EntityPool* zombiePool;
+    ZombieGrid* zombieGrid;
+    FlowField* flowField;
+    ZombieType* zombieTypes;
+    int* nearbyZombies;
+    Vector2 playerPos;
+    double currentTime;
+    long tick;
+    bool timeSliced;
+} ZombieJob;
+
+//Each worker has its own slice of nearbyZombies, zombies only write their own entries here.
+//Far zombies refresh their separation on every 2nd, 4th or 8th tick, offset by slot so each tick gets an even share.
+//Seek and the flow field are cheap and stay exact every tick, and movement still integrates every tick with the cached separation.
+void SteerZombiesRange(void* data, int start, int end, int worker) {
+    
+    ZombieJob* job = data;
+    ZombieStore* zombies = job->zombies;
+    int* nearbyZombies = job->nearbyZombies + worker * zombies->maxCapacity;
+    
+    for (int n = start; n < end; n++) {
+        
+        int i = job->zombiePool->activeSlots[n];
+        
+        if (job->flowField != NULL) {
+            ApplyFlowField(zombies, i, job->flowField);
+        }
+        
+        int interval = job->timeSliced ? GetZombieUpdateInterval(zombies, i, job->playerPos) : 1;
+        
+        if (((job->tick + i) & (interval - 1)) == 0) {
+            UpdateZombieSeparation(zombies, i, job->zombieGrid, nearbyZombies);
+        }
+        
+        zombies->xChange[i] += zombies->xSeparation[i];
+        zombies->yChange[i] += zombies->ySeparation[i];
+    }
+    
+}
+
+//Every zombie steers from the positions at the start of the frame, the grid has to be built from them.
+//Positions only change in the integrate step after the parallel part, so the parallel part reads a stable copy.
+void MoveAllZombies(ZombieStore* zombies, EntityPool* zombiePool, ZombieGrid* zombieGrid, FlowField* flowField, JobSystem* jobs, int* nearbyZombies, Vector2 playerPos, long tick, bool timeSliced, float frameTime) {
+    PROFILE_SCOPE("MoveAllZombies");
+    
+    int count = RoundUpToZombieLanes(zombiePool->slotsUsed);
+    
+    SeekPlayerKernel(zombies, count, playerPos);
+    
+    ZombieJob job = {zombies, zombiePool, zombieGrid, flowField, NULL, nearbyZombies, playerPos, 0, tick, timeSliced};
+    ParallelFor(jobs, zombiePool->activeCount, zombieJobGrainSize, SteerZombiesRange, &job);
+    
+    IntegrateZombiesKernel(zombies, count, frameTime);
+    
+}
+
+void AttackCheckRange(void* data, int start, int end, int worker) {
+    
+    (void)worker;
+    ZombieJob* job = data;
+    
+    for (int n = start; n < end; n++) {
+        ZombieAttackCheck(job->zombies, job->zombiePool->activeSlots[n], job->playerPos, job->zombieTypes, job->currentTime);
+    }
+    
+}
+
+void ZombieAttackAll(ZombieStore* zombies, EntityPool* zombiePool, JobSystem* jobs, Vector2 playerPos, ZombieType* zombieTypes, double* playerHealth, double currentTime) {
+    PROFILE_SCOPE("ZombieAttackAll");
+    
+    ZombieJob job = {zombies, zombiePool, NULL, NULL, zombieTypes, NULL, playerPos, currentTime, 0, false};
+    ParallelFor(jobs, zombiePool->activeCount, zombieJobGrainSize, AttackCheckRange, &job);
+    
+    //Damage is added in pool order, whichever thread ran the attack checks
+    for (int n = 0; n < zombiePool->activeCount; n++) {
+        int i = zombiePool->activeSlots[n];
+        
+        if (zombies->pendingDamage[i] > 0) {
+            DamagePlayer(playerHealth, zombies->pendingDamage[i]);
+        }
+    }
+    
+}
+
+//The part of the world on screen, the player is drawn at playerScreenPos
+Rectangle GetViewRect(Vector2 playerPos, Vector2 playerScreenPos) {
+    Rectangle view = {playerPos.x - playerScreenPos.x, playerPos.y - playerScreenPos.y, screenWidth, screenHeight};
+    return(view);
+}
+
+//Tests a circle around the object, counts it as drawn or culled
+bool CullCircle(Rectangle view, Vector2 pos, float radius, CullStats* stats) {
+    
+    if (pos.x + radius < view.x || pos.x - radius > view.x + view.width || pos.y + radius < view.y || pos.y - radius > view.y + view.height) {
+        stats->culled++;
+        return(true);
+    }
+    
+    stats->drawn++;
+    return(false);
+    
+}
+
+void InitDrawBatch(DrawBatch* batch, int capacity) {
+    batch->capacity = capacity;
+    batch->count = 0;
+    batch->vertices = malloc(capacity * sizeof(BatchVertex));
+}
+
+void AddBatchVertex(DrawBatch* batch, float x, float y, Color color) {
+    BatchVertex* vertex = &batch->vertices[batch->count++];
+    vertex->x = x;
+    vertex->y = y;
+    vertex->color = color;
+}
+
+//Same corners and order as DrawRectanglePro with the origin in the middle, cosR and sinR are shared between quads with the same rotation
+void AddCenteredQuad(DrawBatch* batch, float centerX, float centerY, float halfSize, float cosR, float sinR, Color color) {
+    
+    float right = halfSize*cosR;
+    float down = halfSize*sinR;
+    
+    //Top left, bottom left, bottom right, top right
+    AddBatchVertex(batch, centerX - right + down, centerY - down - right, color);
+    AddBatchVertex(batch, centerX - right - down, centerY - down + right, color);
+    AddBatchVertex(batch, centerX + right - down, centerY + down + right, color);
+    AddBatchVertex(batch, centerX + right + down, centerY + down - right, color);
+    
+}
+
+//One rlBegin per chunk, rlgl only flushes between chunks when its buffer is full
+void SubmitDrawBatch(DrawBatch* batch, int mode) {
+    
+    for (int start = 0; start < batch->count; start += batchChunkVertices) {
+        
+        int end = start + batchChunkVertices;
+        if (end > batch->count) {
+            end = batch->count;
+        }
+        
+        rlCheckRenderBatchLimit(end - start);
+        rlBegin(mode);
+        
+        for (int i = start; i < end; i++) {
+            BatchVertex* vertex = &batch->vertices[i];
+            rlColor4ub(vertex->color.r, vertex->color.g, vertex->color.b, vertex->color.a);
+            rlVertex2f(vertex->x, vertex->y);
+        }
+        
+        rlEnd();
+    }
+    
+    batch->count = 0;
+    
+}
+
+//Outline and body go in one after the other so overlapping zombies still cover each other like before
+void AddZombieToBatch(DrawBatch* batch, ZombieStore* zombies, int zombieIndex, ZombieType* zombieTypes, Vector2 zombiePos, Vector2 playerPos, Vector2 playerScreenPos){
+    
+    int zombieSize = zombies->size[zombieIndex];
+    float zombieScreenX = GetPos(playerPos.x, playerScreenPos.x, zombiePos.x);
+    float zombieScreenY = GetPos(playerPos.y, playerScreenPos.y, zombiePos.y);
+    
+    Vector2 steering = {zombies->xChange[zombieIndex], zombies->yChange[zombieIndex]};
+    Vector2 facing = V2Normalize(steering);
+    float cosR = facing.x;
+    float sinR = facing.y;
+    
+    //Draw outline
+    AddCenteredQuad(batch, zombieScreenX, zombieScreenY, zombieSize/2 + 4, cosR, sinR, BLACK);
+    
+    //Draw Zombie
+    AddCenteredQuad(batch, zombieScreenX, zombieScreenY, zombieSize/2, cosR, sinR, zombieTypes[zombies->type[zombieIndex]].color);
+    
+
+}
+
+void ResetZombie(ZombieStore* zombies, EntityPool* zombiePool, int currentZombie) {
+    
+    //Free slots still go through the movement kernels, zero speed keeps them still
+    zombies->speed[currentZombie] = 0;
+    ReleaseEntity(zombiePool, currentZombie);
+    
+}
+
+
+bool GrowBullets(Bullet* bullets, EntityPool* bulletPool, int capacity) {
+    
+    int oldCapacity = bulletPool->capacity;
+    
+    if (capacity <= oldCapacity) {
+        return(true);
+    }
+    
+    //Fresh pages are zeroed, which is an empty hit set
+    return(CommitEntityArray(bullets, sizeof(Bullet), oldCapacity, capacity) && GrowEntityPool(bulletPool, capacity));
+}
+
+//Reserves a whole burst, growing the store by as many chunks as it needs first.
+//Returns how many bullets it got, their slots are the last entries of the pool's activeSlots.
+int AllocateBullets(Bullet* bullets, EntityPool* bulletPool, int count) {
+    
+    if (count > bulletPool->freeCount) {
+        
+        int chunkCount = (count - bulletPool->freeCount + bulletChunkSize - 1) / bulletChunkSize;
+        int capacity = bulletPool->capacity + chunkCount * bulletChunkSize;
+        
+        if (capacity > bulletPool->maxCapacity) {
+            capacity = bulletPool->maxCapacity;
+        }
+        
+        GrowBullets(bullets, bulletPool, capacity);
+    }
+    
+    return(AllocateEntities(bulletPool, count));
+}
+
+//Each pellet is turned off the aim by (rand(201) - 100) / accuracy degrees, so a burst only has 201 possible directions.
+//They are built from one rotation step instead of a sine and cosine per pellet.
+void BuildSpreadDirections(Vector2 aim, float stepDegrees, Vector2* directions) {
+    
+    Vector2 step = V2FromDegrees(stepDegrees);
+    Vector2 left = aim;
+    Vector2 right = aim;
+    directions[100] = aim;
+    
+    for (int k = 1; k <= 100; k++) {
+        left = V2Rotate(left, step.x, -step.y);
+        right = V2Rotate(right, step.x, step.y);
+        directions[100 - k] = left;
+        directions[100 + k] = right;
+    }
+    
+}
+
+void CreateBullets(Gun* guns, int currentGun, Bullet* bullet, EntityPool* bulletPool, float direction, Vector2 origin, int playerBonusStatsIndex) {
+    
+    //Stats shared by the whole burst
+    int bulletCount = guns[currentGun].bulletCount + guns[playerBonusStatsIndex].bulletCount;
+    float accuracy = guns[currentGun].accuracy + guns[playerBonusStatsIndex].accuracy;
+    float speed = guns[currentGun].speed + guns[playerBonusStatsIndex].speed;
+    int targetsLeft = guns[currentGun].penetration + guns[playerBonusStatsIndex].penetration;
+    double damage = guns[currentGun].damage + guns[playerBonusStatsIndex].damage;
+    
+    if (bulletCount <= 0) {
+        return;
+    }
+    
+    bulletCount = AllocateBullets(bullet, bulletPool, bulletCount);
+    int* slots = bulletPool->activeSlots + bulletPool->activeCount - bulletCount;
+    
+    Vector2 spreadDirections[201];
+    BuildSpreadDirections(V2FromDegrees(direction), 1.0f/accuracy, spreadDirections);
+    
+    for (int n = 0; n < bulletCount; n++) {
+        
+        int j = slots[n];
+        Vector2 vel = V2Scale(spreadDirections[GenerateRandInt(201)], speed);
+        
+        bullet[j].pos = origin;
+        bullet[j].prevPos = origin;
+        bullet[j].xVel = vel.x;
+        bullet[j].yVel = vel.y;
+        bullet[j].targetsLeft = targetsLeft;
+        bullet[j].gunIndex = currentGun;
+        bullet[j].damage = damage;
+    }
+}
+
+void AddBulletToBatch(DrawBatch* batch, Bullet* bullet, int currentBullet, Vector2 bulletPos, int bulletSize, Vector2 playerPos, Vector2 playerScreenPos) {
+    
+    float bulletScreenX = GetPos(playerPos.x, playerScreenPos.x, bulletPos.x);
+    float bulletScreenY = GetPos(playerPos.y, playerScreenPos.y, bulletPos.y);
+    
+    //The triangle DrawPoly made from three slices, corners in the same winding.
+    //The corners sit at 210, 90 and -30 degrees from the way the bullet was fired.
+    Vector2 vel = {bullet[currentBullet].xVel, bullet[currentBullet].yVel};
+    Vector2 facing = V2Normalize(vel);
+    Vector2 corners[3] = {V2Rotate(facing, -0.8660254f, -0.5f), V2Rotate(facing, 0.0f, 1.0f), V2Rotate(facing, 0.8660254f, -0.5f)};
+    
+    for (int corner = 0; corner < 3; corner++) {
+        AddBatchVertex(batch, bulletScreenX + corners[corner].x*bulletSize, bulletScreenY + corners[corner].y*bulletSize, BLACK);
+    }
+    
+}
+
+double Shoot(Gun* guns, int currentGun, double lastShotTime, Bullet* bullet, EntityPool* bulletPool, Vector2 playerPos, float playerRotation, int playerBonusStatsIndex, double currentTime) {
+
+    double minute = 60.0;
+    
+    
+    if (currentTime - lastShotTime > minute/(guns[currentGun].rpm + guns[playerBonusStatsIndex].rpm)) {
+        
+        CreateBullets(guns, currentGun, bullet, bulletPool, playerRotation, playerPos, playerBonusStatsIndex);
+        return currentTime;
+    }
+    
+    return lastShotTime;
+    
+}
+
+unsigned int HashEntityHandle(EntityHandle handle) {
+    
+    handle ^= handle >> 33;
+    handle *= 0xff51afd7ed558ccdULL;
+    handle ^= handle >> 33;
+    
+    return((unsigned int)handle);
+}
+
+//Returns the table slot holding handle, or the empty one it would go in
+int FindHitSetSlot(EntityHandle* table, int tableSize, EntityHandle handle) {
+    
+    int i = HashEntityHandle(handle) & (tableSize - 1);
+    
+    while (table[i] != 0 && table[i] != handle) {
+        i = (i + 1) & (tableSize - 1);
+    }
+    
+    return(i);
+}
+
+//The table is kept at most half full. Spilling reuses the table the slot already has,
+//a bigger one comes from the arena and the outgrown one stays there unused.
+void GrowHitSetTable(HitSet* set, LinearArena* arena) {
+    
+    int inlineSize = sizeof(set->inlineHits) / sizeof(set->inlineHits[0]);
+    int oldSize = set->tableSize;
+    EntityHandle* oldTable = set->table;
+    
+    if (oldSize == 0 && set->tableCapacity > 0) {
+        set->tableSize = set->tableCapacity;
+    } else {
+        set->tableSize = (oldSize == 0) ? inlineSize * 4 : oldSize * 2;
+        set->tableCapacity = set->tableSize;
+        set->table = PushLinearArena(arena, set->tableSize * sizeof(EntityHandle));
+    }
+    
+    memset(set->table, 0, set->tableSize * sizeof(EntityHandle));
+    
+    if (oldSize == 0) {
+        for (int i = 0; i < set->count; i++) {
+            set->table[FindHitSetSlot(set->table, set->tableSize, set->inlineHits[i])] = set->inlineHits[i];
+        }
+    } else {
+        for (int i = 0; i < oldSize; i++) {
+            if (oldTable[i] != 0) {
+                set->table[FindHitSetSlot(set->table, set->tableSize, oldTable[i])] = oldTable[i];
+            }
+        }
+    }
+    
+}
+
+//Returns false if handle was already in the set
+bool AddToHitSet(HitSet* set, EntityHandle handle, LinearArena* arena) {
+    
+    int inlineSize = sizeof(set->inlineHits) / sizeof(set->inlineHits[0]);
+    
+    if (set->tableSize == 0) {
+        
+        for (int i = 0; i < set->count; i++) {
+            if (set->inlineHits[i] == handle) {
+                return(false);
+            }
+        }
+        
+        if (set->count < inlineSize) {
+            set->inlineHits[set->count] = handle;
+            set->count++;
+            return(true);
+        }
+        
+        GrowHitSetTable(set, arena);
+        
+    } else if (set->table[FindHitSetSlot(set->table, set->tableSize, handle)] == handle) {
+        return(false);
+    }
+    
+    if ((set->count + 1) * 2 > set->tableSize) {
+        GrowHitSetTable(set, arena);
+    }
+    
+    set->table[FindHitSetSlot(set->table, set->tableSize, handle)] = handle;
+    set->count++;
+    
+    return(true);
+}
+
+//Keeps the table for the next bullet in the slot
+void ClearHitSet(HitSet* set) {
+    set->tableSize = 0;
+    set->count = 0;
+}
+
+void ResetBullet(Bullet* bullet, EntityPool* bulletPool, int currentBullet) {
+    ReleaseEntity(bulletPool, currentBullet);
+    bullet[currentBullet].xVel = 0;
+    bullet[currentBullet].yVel = 0;
+    ClearHitSet(&bullet[currentBullet].zombiesHit);
+    
+}
+
+void MoveBullet(Bullet* bullet, EntityPool* bulletPool, int currentBullet, Vector2 playerPos, float frameTime) {
+    bullet[currentBullet].pos.x -= bullet[currentBullet].xVel*frameTime;
+    bullet[currentBullet].pos.y -= bullet[currentBullet].yVel*frameTime;
+    
+    int bulletDespawnDistance = screenWidth/2 + 100;
+    
+    if (bullet[currentBullet].pos.x > playerPos.x + bulletDespawnDistance || bullet[currentBullet].pos.x < playerPos.x - bulletDespawnDistance) {
+        ResetBullet(bullet, bulletPool, currentBullet);
+    } else if (bullet[currentBullet].pos.y > playerPos.y + bulletDespawnDistance || bullet[currentBullet].pos.y < playerPos.y - bulletDespawnDistance) {
+        ResetBullet(bullet, bulletPool, currentBullet);
+    }
+    
+}
+
+//Slab test of the segment from start to end against the zombie's rectangle.
+//Returns true and the entry point along the segment in [0, 1] in t, 0 when start is already inside.
+bool SweepBulletZombie(Vector2 start, Vector2 end, ZombieStore* zombies, int currentZombie, float* t) {
+    
+    float halfSize = zombies->size[currentZombie]/2;
+    float zombieX = zombies->x[currentZombie];
+    float zombieY = zombies->y[currentZombie];
+    
+    float tEnter = 0;
+    float tExit = 1;
+    
+    float startAxis[2] = {start.x, start.y};
+    float deltaAxis[2] = {end.x - start.x, end.y - start.y};
+    float minAxis[2] = {zombieX - halfSize, zombieY - halfSize};
+    float maxAxis[2] = {zombieX + halfSize, zombieY + halfSize};
+    
+    for (int axis = 0; axis < 2; axis++) {
+        
+        //A path parallel to this axis' slab either stays inside it or misses
+        if (deltaAxis[axis] == 0) {
+            if (startAxis[axis] < minAxis[axis] || startAxis[axis] > maxAxis[axis]) {
+                return(false);
+            }
+            continue;
+        }
+        
+        float tMin = (minAxis[axis] - startAxis[axis]) / deltaAxis[axis];
+        float tMax = (maxAxis[axis] - startAxis[axis]) / deltaAxis[axis];
+        
+        if (tMin > tMax) {
+            float swap = tMin;
+            tMin = tMax;
+            tMax = swap;
+        }
+        
+        if (tMin > tEnter) {
+            tEnter = tMin;
+        }
+        if (tMax < tExit) {
+            tExit = tMax;
+        }
+        
+        if (tEnter > tExit) {
+            return(false);
+        }
+    }
+    
+    *t = tEnter;
+    return(true);
+    
+}
+
+
+
+//Circles are fans of triangles around the precomputed unit circle, like DrawCircle but with fewer slices
+void AddParticleToBatch(DrawBatch* batch, Vector2* circlePoints, Vector2 particlePos, int size, float direction, Color color, int shape, Vector2 playerPos, Vector2 playerScreenPos) {
+    
+    float screenX = GetPos(playerPos.x, playerScreenPos.x, particlePos.x);
+    float screenY = GetPos(playerPos.y, playerScreenPos.y, particlePos.y);
+
+    if (shape == 0) {
+        for (int i = 0; i < particleCircleSegments; i++) {
+            AddBatchVertex(batch, screenX, screenY, color);
+            AddBatchVertex(batch, screenX + circlePoints[i + 1].x*size, screenY + circlePoints[i + 1].y*size, color);
+            AddBatchVertex(batch, screenX + circlePoints[i].x*size, screenY + circlePoints[i].y*size, color);
+        }
+    }
+    else if (shape == 1) {
+        //Squares go in as two triangles so particles stay one batch
+        float half = size/2.0f;
+        float right = half*cosf(direction*DEG2RAD);
+        float down = half*sinf(direction*DEG2RAD);
+        
+        Vector2 topLeft = {screenX - right + down, screenY - down - right};
+        Vector2 bottomLeft = {screenX - right - down, screenY - down + right};
+        Vector2 bottomRight = {screenX + right - down, screenY + down + right};
+        Vector2 topRight = {screenX + right + down, screenY + down - right};
+        
+        AddBatchVertex(batch, topLeft.x, topLeft.y, color);
+        AddBatchVertex(batch, bottomLeft.x, bottomLeft.y, color);
+        AddBatchVertex(batch, topRight.x, topRight.y, color);
+        AddBatchVertex(batch, topRight.x, topRight.y, color);
+        AddBatchVertex(batch, bottomLeft.x, bottomLeft.y, color);
+        AddBatchVertex(batch, bottomRight.x, bottomRight.y, color);
+    }
+}
+
+Vector2 SetParticleVel(Vector2 originVel, float velChangeMax) {
+
+    Vector2 returnVel = originVel;
+
+    float velChangePercent = (float)GenerateRandInt(100)/100; 
+    returnVel.x += (velChangeMax/2 - velChangeMax * velChangePercent);
+
+    velChangePercent = (float)GenerateRandInt(100)/100; 
+    returnVel.y += (velChangeMax/2 - velChangeMax * velChangePercent);
+    
+    return returnVel;
+    
+}
+
+double SetParticleLifeTime(double lifeTime, double lifeTimeDiffMax) {
+    
+    double lifeTimeChangePercent = (double)GenerateRandInt(100)/100; 
+    double returnTime = lifeTime + (lifeTimeDiffMax/2 - lifeTimeDiffMax * lifeTimeChangePercent);
+
+    return returnTime;
+    
+}
+
+
+int RoundUpToParticleLanes(int count) {
+    return ((count + particleLanes - 1) / particleLanes) * particleLanes;
+}
+
+bool GrowParticleStore(ParticleStore* particles, int capacity) {
+    
+    capacity = RoundUpToParticleLanes(capacity);
+    int oldCapacity = particles->capacity;
+    
+    if (capacity <= oldCapacity) {
+        return(true);
+    }
+    
+    bool committed = capacity <= particles->maxCapacity;
+    
+    void* floatArrays[12] = {particles->x, particles->y, particles->prevX, particles->prevY, particles->velX, particles->velY, particles->life, particles->lifeTime, particles->drag, particles->speed, particles->rotation, particles->size};
+    for (int i = 0; i < 12 && committed; i++) {
+        committed = CommitEntityArray(floatArrays[i], sizeof(float), oldCapacity, capacity);
+    }
+    
+    committed = committed && CommitEntityArray(particles->shape, sizeof(unsigned char), oldCapacity, capacity);
+    committed = committed && CommitEntityArray(particles->color, sizeof(Color), oldCapacity, capacity);
+    
+    if (committed) {
+        particles->capacity = capacity;
+    }
+    
+    return(committed);
+}
+
+void InitParticleStore(ParticleStore* particles, EntityArena* arena, int capacity, int maxCapacity) {
+    
+    maxCapacity = RoundUpToParticleLanes(maxCapacity);
+    
+    particles->capacity = 0;
+    particles->maxCapacity = maxCapacity;
+    particles->count = 0;
+    particles->x = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->y = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->prevX = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->prevY = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->velX = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->velY = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->life = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->lifeTime = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->drag = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->speed = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->rotation = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->size = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    particles->shape = ReserveEntityArray(arena, sizeof(unsigned char), maxCapacity, 0);
+    particles->color = ReserveEntityArray(arena, sizeof(Color), maxCapacity, 0);
+    
+    GrowParticleStore(particles, (capacity < maxCapacity) ? capacity : maxCapacity);
+    
+}
+
+void CreateParticles(ParticleStore* particles, Vector2 originPos, Vector2 originVel, float velChangeMax, int shape, Color color, int size, int count, float rotation, double lifeTime, double lifeTimeDiffMax, int type) {
+    
+    
+    for (int i = 0; i < count; i++) {
+        
+        //Effects are dropped once the store is full at its maximum
+        if (particles->count == particles->capacity) {
+            
+            int capacity = GetGrownCapacity(particles->capacity, particles->maxCapacity, particleChunkSize);
+            
+            if (capacity == 0 || !GrowParticleStore(particles, capacity)) {
+                break;
+            }
+        }
+        
+        int j = particles->count++;
+        Vector2 vel = SetParticleVel(originVel, velChangeMax);
+        
+        particles->x[j] = originPos.x;
+        particles->y[j] = originPos.y;
+        particles->prevX[j] = originPos.x;
+        particles->prevY[j] = originPos.y;
+        particles->velX[j] = vel.x;
+        particles->velY[j] = vel.y;
+        particles->size[j] = size;
+        particles->shape[j] = shape;
+        particles->color[j] = color;
+        particles->lifeTime[j] = SetParticleLifeTime(lifeTime, lifeTimeDiffMax);
+        particles->life[j] = particles->lifeTime[j];
+        particles->drag[j] = (type == 1) ? 1.0f : 0.0f;
+        particles->speed[j] = V2Length(vel);
+        
+        if (rotation != 0) {
+            particles->rotation[j] = rotation;
+        } else {
+            Vector2 zero = {0, 0};
+            particles->rotation[j] = GetAngle(zero, vel);
+        }
+        
+    }
+    
+}
+
+
+void DrawAllParticles (DrawBatch* batch, Vector2* circlePoints, ParticleStore* particles, Vector2 playerPos, Vector2 playerScreenPos, float alpha, Rectangle view, CullStats* cullStats) {
+    PROFILE_SCOPE("DrawAllParticles");
+    
+    for (int i = 0; i < particles->count; i++) {
+        
+        if (particles->life[i] > 0) {
+            
+            Vector2 prevPos = {particles->prevX[i], particles->prevY[i]};
+            Vector2 currentPos = {particles->x[i], particles->y[i]};
+            Vector2 pos = LerpPos(prevPos, currentPos, alpha);
+            
+            //size is the radius of a circle and more than half the diagonal of a square
+            if (CullCircle(view, pos, particles->size[i], cullStats)) {
+                continue;
+            }
+            
+            AddParticleToBatch(batch, circlePoints, pos, particles->size[i], particles->rotation[i], particles->color[i], particles->shape[i], playerPos, playerScreenPos); 
+            
+        }
+        
+    }
+    
+    SubmitDrawBatch(batch, RL_TRIANGLES);
+    
+}
+
+//log2 and exp2 for the slowdown, the power comes out within about 2e-6 of pow which is plenty for blood.
+//The SIMD versions below do the same steps so every build moves particles the same way.
+typedef union FloatBits {
+    float f;
+    int i;
+} FloatBits;
+
+float FastLog2(float value) {
+    
+    FloatBits bits = {value};
+    float exponent = ((bits.i >> 23) & 0xff) - 127;
+    bits.i = (bits.i & 0x7fffff) | 0x3f800000;
+    float mantissa = bits.f;
+    
+    if (mantissa > 1.41421356f) {
+        mantissa *= 0.5f;
+        exponent += 1;
+    }
+    
+    //ln(m) = 2*atanh((m - 1)/(m + 1)), the series converges fast for m close to 1
+    float s = (mantissa - 1)/(mantissa + 1);
+    float s2 = s*s;
+    float ln = 2*s*(1 + s2*(1/3.0f + s2*(1/5.0f + s2*(1/7.0f))));
+    
+    return(exponent + ln*1.44269504f);
+    
+}
+
+//Arguments below -126 give 2^-126, the smallest normal float, instead of a wrapped exponent
+float FastExp2(float value) {
+    
+    value = (value > -126) ? value : -126;
+    float whole = (float)(int)lrintf(value);
+    float t = (value - whole)*0.69314718f;
+    float fraction = 1 + t*(1 + t*(1/2.0f + t*(1/6.0f + t*(1/24.0f + t*(1/120.0f + t*(1/720.0f))))));
+    
+    FloatBits scale;
+    scale.i = ((int)whole + 127) << 23;
+    
+    return(fraction * scale.f);
+    
+}
+
+#if defined(__AVX2__)
+__m256 FastLog2Lanes(__m256 value) {
+    
+    __m256i bits = _mm256_castps_si256(value);
+    __m256 exponent = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(0xff)), _mm256_set1_epi32(127)));
+    __m256 mantissa = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)), _mm256_set1_epi32(0x3f800000)));
+    
+    __m256 big = _mm256_cmp_ps(mantissa, _mm256_set1_ps(1.41421356f), _CMP_GT_OQ);
+    mantissa = _mm256_blendv_ps(mantissa, _mm256_mul_ps(mantissa, _mm256_set1_ps(0.5f)), big);
+    exponent = _mm256_add_ps(exponent, _mm256_and_ps(big, _mm256_set1_ps(1)));
+    
+    __m256 one = _mm256_set1_ps(1);
+    __m256 s = _mm256_div_ps(_mm256_sub_ps(mantissa, one), _mm256_add_ps(mantissa, one));
+    __m256 s2 = _mm256_mul_ps(s, s);
+    __m256 series = _mm256_add_ps(_mm256_set1_ps(1/5.0f), _mm256_mul_ps(s2, _mm256_set1_ps(1/7.0f)));
+    series = _mm256_add_ps(_mm256_set1_ps(1/3.0f), _mm256_mul_ps(s2, series));
+    series = _mm256_add_ps(one, _mm256_mul_ps(s2, series));
+    __m256 ln = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(2), s), series);
+    
+    return _mm256_add_ps(exponent, _mm256_mul_ps(ln, _mm256_set1_ps(1.44269504f)));
+}
+
+__m256 FastExp2Lanes(__m256 value) {
+    
+    value = _mm256_max_ps(value, _mm256_set1_ps(-126));
+    __m256i wholeInt = _mm256_cvtps_epi32(value);
+    __m256 t = _mm256_mul_ps(_mm256_sub_ps(value, _mm256_cvtepi32_ps(wholeInt)), _mm256_set1_ps(0.69314718f));
+    
+    __m256 fraction = _mm256_add_ps(_mm256_set1_ps(1/120.0f), _mm256_mul_ps(t, _mm256_set1_ps(1/720.0f)));
+    fraction = _mm256_add_ps(_mm256_set1_ps(1/24.0f), _mm256_mul_ps(t, fraction));
+    fraction = _mm256_add_ps(_mm256_set1_ps(1/6.0f), _mm256_mul_ps(t, fraction));
+    fraction = _mm256_add_ps(_mm256_set1_ps(1/2.0f), _mm256_mul_ps(t, fraction));
+    fraction = _mm256_add_ps(_mm256_set1_ps(1), _mm256_mul_ps(t, fraction));
+    fraction = _mm256_add_ps(_mm256_set1_ps(1), _mm256_mul_ps(t, fraction));
+    
+    __m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(wholeInt, _mm256_set1_epi32(127)), 23));
+    
+    return _mm256_mul_ps(fraction, scale);
+}
+#elif defined(__SSE2__)
+__m128 FastLog2Lanes(__m128 value) {
+    
+    __m128i bits = _mm_castps_si128(value);
+    __m128 exponent = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xff)), _mm_set1_epi32(127)));
+    __m128 mantissa = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)), _mm_set1_epi32(0x3f800000)));
+    
+    __m128 big = _mm_cmpgt_ps(mantissa, _mm_set1_ps(1.41421356f));
+    mantissa = _mm_or_ps(_mm_and_ps(big, _mm_mul_ps(mantissa, _mm_set1_ps(0.5f))), _mm_andnot_ps(big, mantissa));
+    exponent = _mm_add_ps(exponent, _mm_and_ps(big, _mm_set1_ps(1)));
+    
+    __m128 one = _mm_set1_ps(1);
+    __m128 s = _mm_div_ps(_mm_sub_ps(mantissa, one), _mm_add_ps(mantissa, one));
+    __m128 s2 = _mm_mul_ps(s, s);
+    __m128 series = _mm_add_ps(_mm_set1_ps(1/5.0f), _mm_mul_ps(s2, _mm_set1_ps(1/7.0f)));
+    series = _mm_add_ps(_mm_set1_ps(1/3.0f), _mm_mul_ps(s2, series));
+    series = _mm_add_ps(one, _mm_mul_ps(s2, series));
+    __m128 ln = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2), s), series);
+    
+    return _mm_add_ps(exponent, _mm_mul_ps(ln, _mm_set1_ps(1.44269504f)));
+}
+
+__m128 FastExp2Lanes(__m128 value) {
+    
+    value = _mm_max_ps(value, _mm_set1_ps(-126));
+    __m128i wholeInt = _mm_cvtps_epi32(value);
+    __m128 t = _mm_mul_ps(_mm_sub_ps(value, _mm_cvtepi32_ps(wholeInt)), _mm_set1_ps(0.69314718f));
+    
+    __m128 fraction = _mm_add_ps(_mm_set1_ps(1/120.0f), _mm_mul_ps(t, _mm_set1_ps(1/720.0f)));
+    fraction = _mm_add_ps(_mm_set1_ps(1/24.0f), _mm_mul_ps(t, fraction));
+    fraction = _mm_add_ps(_mm_set1_ps(1/6.0f), _mm_mul_ps(t, fraction));
+    fraction = _mm_add_ps(_mm_set1_ps(1/2.0f), _mm_mul_ps(t, fraction));
+    fraction = _mm_add_ps(_mm_set1_ps(1), _mm_mul_ps(t, fraction));
+    fraction = _mm_add_ps(_mm_set1_ps(1), _mm_mul_ps(t, fraction));
+    
+    __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(wholeInt, _mm_set1_epi32(127)), 23));
+    
+    return _mm_mul_ps(fraction, scale);
+}
+#endif
+
+//Moves every particle in a straight line and counts its life down, then slows the drag particles with
+//vel *= (life/lifeTime)^(frameTime*fps). life/lifeTime is clamped to [1e-30, 1] and the factor bottoms out
+//at 2^-126, so a particle at the end of its life stops rather than following the formula to 0.
+//Particles without drag get an exponent of 0, a factor of exactly 1.
+void IntegrateParticlesKernel(ParticleStore* particles, int count, float frameTime) {
+    
+    //Tuned as a per frame slowdown at 160 fps, scaled so the tick rate does not change how far blood flies
+    float slowDownPower = frameTime * fps;
+    
+    for (int i = 0; i < count; i += particleLanes) {
+        
+#if defined(__AVX2__)
+        __m256 dt = _mm256_set1_ps(frameTime);
+        __m256 velX = _mm256_loadu_ps(particles->velX + i);
+        __m256 velY = _mm256_loadu_ps(particles->velY + i);
+        __m256 life = _mm256_sub_ps(_mm256_loadu_ps(particles->life + i), dt);
+        
+        _mm256_storeu_ps(particles->x + i, _mm256_sub_ps(_mm256_loadu_ps(particles->x + i), _mm256_mul_ps(velX, dt)));
+        _mm256_storeu_ps(particles->y + i, _mm256_sub_ps(_mm256_loadu_ps(particles->y + i), _mm256_mul_ps(velY, dt)));
+        _mm256_storeu_ps(particles->life + i, life);
+        
+        //max(nan, x) gives x, so padding slots with a lifeTime of 0 stay finite
+        __m256 lifePercent = _mm256_div_ps(life, _mm256_loadu_ps(particles->lifeTime + i));
+        lifePercent = _mm256_min_ps(_mm256_max_ps(lifePercent, _mm256_set1_ps(1e-30f)), _mm256_set1_ps(1));
+        __m256 power = _mm256_mul_ps(_mm256_loadu_ps(particles->drag + i), _mm256_set1_ps(slowDownPower));
+        __m256 slowDown = FastExp2Lanes(_mm256_mul_ps(power, FastLog2Lanes(lifePercent)));
+        
+        _mm256_storeu_ps(particles->velX + i, _mm256_mul_ps(velX, slowDown));
+        _mm256_storeu_ps(particles->velY + i, _mm256_mul_ps(velY, slowDown));
+#elif defined(__SSE2__)
+        __m128 dt = _mm_set1_ps(frameTime);
+        for (int half = i; half < i + particleLanes; half += 4) {
+            __m128 velX = _mm_loadu_ps(particles->velX + half);
+            __m128 velY = _mm_loadu_ps(particles->velY + half);
+            __m128 life = _mm_sub_ps(_mm_loadu_ps(particles->life + half), dt);
+            
+            _mm_storeu_ps(particles->x + half, _mm_sub_ps(_mm_loadu_ps(particles->x + half), _mm_mul_ps(velX, dt)));
+            _mm_storeu_ps(particles->y + half, _mm_sub_ps(_mm_loadu_ps(particles->y + half), _mm_mul_ps(velY, dt)));
+            _mm_storeu_ps(particles->life + half, life);
+            
+            __m128 lifePercent = _mm_div_ps(life, _mm_loadu_ps(particles->lifeTime + half));
+            lifePercent = _mm_min_ps(_mm_max_ps(lifePercent, _mm_set1_ps(1e-30f)), _mm_set1_ps(1));
+            __m128 power = _mm_mul_ps(_mm_loadu_ps(particles->drag + half), _mm_set1_ps(slowDownPower));
+            __m128 slowDown = FastExp2Lanes(_mm_mul_ps(power, FastLog2Lanes(lifePercent)));
+            
+            _mm_storeu_ps(particles->velX + half, _mm_mul_ps(velX, slowDown));
+            _mm_storeu_ps(particles->velY + half, _mm_mul_ps(velY, slowDown));
+        }
+#else
+        for (int j = i; j < i + particleLanes; j++) {
+            particles->x[j] -= particles->velX[j] * frameTime;
+            particles->y[j] -= particles->velY[j] * frameTime;
+            particles->life[j] -= frameTime;
+            
+            float lifePercent = particles->life[j] / particles->lifeTime[j];
+            lifePercent = (lifePercent > 1e-30f) ? lifePercent : 1e-30f;
+            lifePercent = (lifePercent < 1) ? lifePercent : 1;
+            float slowDown = FastExp2(particles->drag[j] * slowDownPower * FastLog2(lifePercent));
+            
+            particles->velX[j] *= slowDown;
+            particles->velY[j] *= slowDown;
+        }
+#endif
+        
+    }
+    
+}
+
+//Copies the last live particle over a dead one
+void RemoveParticle(ParticleStore* particles, int currentParticle) {
+    
+    int last = --particles->count;
+    
+    particles->x[currentParticle] = particles->x[last];
+    particles->y[currentParticle] = particles->y[last];
+    particles->prevX[currentParticle] = particles->prevX[last];
+    particles->prevY[currentParticle] = particles->prevY[last];
+    particles->velX[currentParticle] = particles->velX[last];
+    particles->velY[currentParticle] = particles->velY[last];
+    particles->life[currentParticle] = particles->life[last];
+    particles->lifeTime[currentParticle] = particles->lifeTime[last];
+    particles->drag[currentParticle] = particles->drag[last];
+    particles->speed[currentParticle] = particles->speed[last];
+    particles->rotation[currentParticle] = particles->rotation[last];
+    particles->size[currentParticle] = particles->size[last];
+    particles->shape[currentParticle] = particles->shape[last];
+    particles->color[currentParticle] = particles->color[last];
+    
+}
+
+void MoveAllParticles (ParticleStore* particles, float frameTime) {
+    PROFILE_SCOPE("MoveAllParticles");
+    
+    int count = ((particles->count + particleLanes - 1) / particleLanes) * particleLanes;
+    IntegrateParticlesKernel(particles, count, frameTime);
+    
+    //Dead particles are filled from the back, so a slot is checked again after a swap
+    int i = 0;
+    while (i < particles->count) {
+        if (particles->life[i] <= 0) {
+            RemoveParticle(particles, i);
+        } else {
+            i++;
+        }
+    }
+    
+}
+
+
+void AddBloodExplosion(ParticleStore* particles, Color color, Vector2 bulletVel, Vector2 bulletPos, int zombieSize) {
+    
+    int bloodCount = zombieSize/4;
+    float velChangeMax = 45*zombieSize;
+    float rotation = 0;
+    int shape = 0;
+    int size = zombieSize/8;
+    double bloodLifeTime = 2.0;
+    double LifeTimeDiffMax = 0.25;
+    int moveType = 1;
+    
+    CreateParticles(particles, bulletPos, bulletVel, velChangeMax, shape, color, size, bloodCount, rotation, bloodLifeTime, LifeTimeDiffMax, moveType);
+    
+}
+
+void AddBloodSplatter(ParticleStore* particles, Color color, Vector2 bulletVel, Vector2 bulletPos, int zombieSize) {
+    
+    int bloodCount = 4;
+    float velChangeMax = 300;
+    float rotation = 0;
+    int shape = 0;
+    int size = zombieSize/10;
+    double bloodLifeTime = 2;
+    double LifeTimeDiffMax = 0.5;
+    int moveType = 1;
+    
+    CreateParticles(particles, bulletPos, bulletVel, velChangeMax, shape, color, size, bloodCount, rotation, bloodLifeTime, LifeTimeDiffMax, moveType);
+    
+}
+
+//Orbs grow with the experience they carry
+float GetOrbSize(float value) {
+    return(orbSize + sqrtf(value) - 1);
+}
+
+int RoundUpToPowerOfTwo(int value) {
+    
+    int result = 1;
+    while (result < value) {
+        result *= 2;
+    }
+    
+    return(result);
+}
+
+bool GrowOrbStore(OrbStore* orbs, int capacity) {
+    
+    int oldCapacity = orbs->capacity;
+    
+    if (capacity <= oldCapacity) {
+        return(true);
+    }
+    
+    bool committed = capacity <= orbs->maxCapacity;
+    
+    void* floatArrays[8] = {orbs->x, orbs->y, orbs->prevX, orbs->prevY, orbs->velX, orbs->velY, orbs->life, orbs->value};
+    for (int i = 0; i < 8 && committed; i++) {
+        committed = CommitEntityArray(floatArrays[i], sizeof(float), oldCapacity, capacity);
+    }
+    
+    if (committed) {
+        orbs->capacity = capacity;
+    }
+    
+    return(committed);
+}
+
+void InitOrbStore(OrbStore* orbs, EntityArena* arena, int capacity, int maxCapacity) {
+    
+    orbs->capacity = 0;
+    orbs->maxCapacity = maxCapacity;
+    orbs->count = 0;
+    orbs->x = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    orbs->y = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    orbs->prevX = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    orbs->prevY = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    orbs->velX = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    orbs->velY = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    orbs->life = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    orbs->value = ReserveEntityArray(arena, sizeof(float), maxCapacity, 0);
+    
+    //The merge table is at most half full
+    int tableSize = RoundUpToPowerOfTwo(maxCapacity * 2);
+    orbs->cellKeys = ReserveEntityArray(arena, sizeof(long long), tableSize, tableSize);
+    orbs->cellOrbs = ReserveEntityArray(arena, sizeof(int), tableSize, tableSize);
+    
+    GrowOrbStore(orbs, (capacity < maxCapacity) ? capacity : maxCapacity);
+    
+}
+
+//A killed zombie drops its experience split over a few orbs that burst out from where it died
+void AddExperienceOrbs(OrbStore* orbs, Vector2 pos, int expCount) {
+    
+    float velChangeMax = 1500;
+    double LifeTimeDiffMax = 0.25;
+    Vector2 zero = {0, 0};
+    
+    int orbCount = (expCount < maxOrbsPerKill) ? expCount : maxOrbsPerKill;
+    
+    for (int i = 0; i < orbCount; i++) {
+        
+        if (orbs->count == orbs->capacity) {
+            
+            int capacity = GetGrownCapacity(orbs->capacity, orbs->maxCapacity, orbChunkSize);
+            
+            if (capacity == 0 || !GrowOrbStore(orbs, capacity)) {
+                break;
+            }
+        }
+        
+        int j = orbs->count++;
+        Vector2 vel = SetParticleVel(zero, velChangeMax);
+        
+        orbs->x[j] = pos.x;
+        orbs->y[j] = pos.y;
+        orbs->prevX[j] = pos.x;
+        orbs->prevY[j] = pos.y;
+        orbs->velX[j] = vel.x;
+        orbs->velY[j] = vel.y;
+        orbs->life[j] = SetParticleLifeTime(orbLifeTime, LifeTimeDiffMax);
+        orbs->value[j] = (float)expCount / orbCount;
+    }
+    
+}
+
+void RemoveOrb(OrbStore* orbs, int currentOrb) {
+    
+    int last = --orbs->count;
+    
+    orbs->x[currentOrb] = orbs->x[last];
+    orbs->y[currentOrb] = orbs->y[last];
+    orbs->prevX[currentOrb] = orbs->prevX[last];
+    orbs->prevY[currentOrb] = orbs->prevY[last];
+    orbs->velX[currentOrb] = orbs->velX[last];
+    orbs->velY[currentOrb] = orbs->velY[last];
+    orbs->life[currentOrb] = orbs->life[last];
+    orbs->value[currentOrb] = orbs->value[last];
+    
+}
+
+//Orbs spiral in on the target: constant speed, turning a fixed step a tick towards whichever side the target is on
+void SteerOrbs(OrbStore* orbs, Vector2 target, float turnCos, float turnSin, float frameTime) {
+    
+    for (int i = 0; i < orbs->count; i++) {
+        
+        Vector2 pos = {orbs->x[i], orbs->y[i]};
+        Vector2 vel = {orbs->velX[i], orbs->velY[i]};
+        
+        if (V2Cross(vel, V2Sub(target, pos)) > 0) {
+            vel = V2Rotate(vel, turnCos, turnSin);
+        } else {
+            vel = V2Rotate(vel, turnCos, -turnSin);
+        }
+        
+        orbs->velX[i] = vel.x;
+        orbs->velY[i] = vel.y;
+        orbs->x[i] += vel.x * frameTime;
+        orbs->y[i] += vel.y * frameTime;
+        orbs->life[i] -= frameTime;
+    }
+    
+}
+
+//Orbs that have flown for a moment and share a merge cell become one orb with the summed value, at their value weighted centre.
+//Cells are found through a hash table keyed on the cell, so the pass is linear in the orb count.
+void MergeOrbs(OrbStore* orbs) {
+    
+    int tableSize = RoundUpToPowerOfTwo(orbs->count * 2);
+    if (tableSize < 16) {
+        tableSize = 16;
+    }
+    
+    for (int i = 0; i < tableSize; i++) {
+        orbs->cellOrbs[i] = -1;
+    }
+    
+    for (int i = 0; i < orbs->count; i++) {
+        
+        if (orbs->life[i] <= 0 || orbs->life[i] > orbLifeTime - orbMergeDelay) {
+            continue;
+        }
+        
+        long long column = (long long)floorf(orbs->x[i] / orbMergeCellSize);
+        long long row = (long long)floorf(orbs->y[i] / orbMergeCellSize);
+        long long key = (long long)(((unsigned long long)row << 32) ^ (column & 0xffffffff));
+        
+        int slot = HashEntityHandle(key) & (tableSize - 1);
+        while (orbs->cellOrbs[slot] != -1 && orbs->cellKeys[slot] != key) {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        
+        int j = orbs->cellOrbs[slot];
+        
+        if (j == -1) {
+            orbs->cellKeys[slot] = key;
+            orbs->cellOrbs[slot] = i;
+            continue;
+        }
+        
+        float value = orbs->value[i] + orbs->value[j];
+        orbs->x[j] = (orbs->x[j] * orbs->value[j] + orbs->x[i] * orbs->value[i]) / value;
+        orbs->y[j] = (orbs->y[j] * orbs->value[j] + orbs->y[i] * orbs->value[i]) / value;
+        orbs->prevX[j] = orbs->x[j];
+        orbs->prevY[j] = orbs->y[j];
+        orbs->value[j] = value;
+        orbs->life[j] = fmaxf(orbs->life[j], orbs->life[i]);
+        orbs->life[i] = 0;
+    }
+    
+}
+
+//Pickup radius query: every orb touching the circle is collected, returns their summed value
+float CollectOrbs(OrbStore* orbs, Vector2 pos, float radius) {
+    
+    float collected = 0;
+    
+    for (int i = 0; i < orbs->count; i++) {
+        
+        float reach = radius + GetOrbSize(orbs->value[i]);
+        Vector2 orbPos = {orbs->x[i], orbs->y[i]};
+        
+        if (orbs->life[i] > 0 && V2DistanceSqr(orbPos, pos) < reach*reach) {
+            collected += orbs->value[i];
+            orbs->life[i] = 0;
+        }
+    }
+    
+    return(collected);
+}
+
+//Returns the experience picked up this tick
+float MoveAllOrbs(OrbStore* orbs, Vector2 playerPos, float frameTime) {
+    PROFILE_SCOPE("MoveAllOrbs");
+    
+    //Orbs turn 360 degrees a second
+    float turnAngle = 2*PI*frameTime;
+    SteerOrbs(orbs, playerPos, cosf(turnAngle), sinf(turnAngle), frameTime);
+    MergeOrbs(orbs);
+    float collected = CollectOrbs(orbs, playerPos, playerSize/2.0f);
+    
+    int i = 0;
+    while (i < orbs->count) {
+        if (orbs->life[i] <= 0) {
+            RemoveOrb(orbs, i);
+        } else {
+            i++;
+        }
+    }
+    
+    return(collected);
+}
+
+void DrawAllOrbs(DrawBatch* batch, Vector2* circlePoints, OrbStore* orbs, Vector2 playerPos, Vector2 playerScreenPos, float alpha, Rectangle view, CullStats* cullStats) {
+    PROFILE_SCOPE("DrawAllOrbs");
+    
+    for (int i = 0; i < orbs->count; i++) {
+        
+        Vector2 prevPos = {orbs->prevX[i], orbs->prevY[i]};
+        Vector2 currentPos = {orbs->x[i], orbs->y[i]};
+        Vector2 pos = LerpPos(prevPos, currentPos, alpha);
+        float size = GetOrbSize(orbs->value[i]);
+        
+        if (CullCircle(view, pos, size, cullStats)) {
+            continue;
+        }
+        
+        AddParticleToBatch(batch, circlePoints, pos, size, 0, GOLD, 0, playerPos, playerScreenPos);
+    }
+    
+    SubmitDrawBatch(batch, RL_TRIANGLES);
+    
+}
+
+void GenerateDetail(MapDetail* mapDetails, int currentDetail) {
+    int spawnX = GenerateRandInt(mapWidth) - mapWidth/2;
+    int spawnY = GenerateRandInt(mapHeight) - mapHeight/2;
+    int type = GenerateRandInt(environmentDetailTypes);
+    
+    mapDetails[currentDetail].pos.x = spawnX;
+    mapDetails[currentDetail].pos.y = spawnY;
+    mapDetails[currentDetail].type = type;
+}
+
+//Draws one detail with its position moved by offset, sizes come from the map's randomizer and never change
+void DrawDetail(MapDetail* mapDetails, int currentDetail, int detailRandomizer, Vector2 offset, Rectangle area, CullStats* cullStats) {
+    
+    int i = currentDetail;
+    Vector2 center = {mapDetails[i].pos.x + offset.x, mapDetails[i].pos.y + offset.y};
+    
+    if (mapDetails[i].type == 0) { //Grass
+        float size = i*detailRandomizer % 100/10 + 1;
+        
+        if (!CullCircle(area, mapDetails[i].pos, size, cullStats)) {
+            DrawCircle(center.x, center.y, size, DARKGREEN);
+        }
+        
+    } else if (mapDetails[i].type == 1) { //Rock
+        float size = i*detailRandomizer % 200/10 + 10;
+        int rotation = i*detailRandomizer % 359;
+        int sides = i*detailRandomizer % 7;
+        
+        if (!CullCircle(area, mapDetails[i].pos, size, cullStats)) {
+            DrawPoly(center, sides, size, rotation, GRAY);
+        }
+    }
+}
+
+//Needs the window to be open. Tiles are opaque, anything outside them is the cleared background.
+void BakeBackground(BackgroundLayer* background, MapDetail* mapDetails, int detailRandomizer) {
+    PROFILE_SCOPE("BakeBackground");
+    
+    Rectangle bounds = {-mapWidth/2 - maxDetailSize, -mapHeight/2 - maxDetailSize, mapWidth + 2*maxDetailSize, mapHeight + 2*maxDetailSize};
+    background->bounds = bounds;
+    background->columns = (bounds.width + backgroundTileSize - 1) / backgroundTileSize;
+    background->rows = (bounds.height + backgroundTileSize - 1) / backgroundTileSize;
+    background->tiles = malloc(background->columns * background->rows * sizeof(RenderTexture2D));
+    
+    CullStats bakeStats = {0, 0};
+    
+    for (int row = 0; row < background->rows; row++) {
+        for (int column = 0; column < background->columns; column++) {
+            
+            Rectangle area = {bounds.x + column*backgroundTileSize, bounds.y + row*backgroundTileSize, backgroundTileSize, backgroundTileSize};
+            Vector2 offset = {-area.x, -area.y};
+            
+            RenderTexture2D tile = LoadRenderTexture(backgroundTileSize, backgroundTileSize);
+            
+            BeginTextureMode(tile);
+            ClearBackground(LIME);
+            for (int i = 0; i < environmentDetailLimit; i++) {
+                DrawDetail(mapDetails, i, detailRandomizer, offset, area, &bakeStats);
+            }
+            EndTextureMode();
+            
+            background->tiles[row * background->columns + column] = tile;
+        }
+    }
+}
+
+void FreeBackground(BackgroundLayer* background) {
+    
+    for (int i = 0; i < background->columns * background->rows; i++) {
+        UnloadRenderTexture(background->tiles[i]);
+    }
+    
+    free(background->tiles);
+}
+
+//Blits only the tiles under the view
+void DrawBackground(BackgroundLayer* background, Vector2 playerPos, Vector2 playerScreenPos, Rectangle view, CullStats* cullStats) {
+    PROFILE_SCOPE("DrawBackground");
+    
+    int firstColumn = fmaxf(floorf((view.x - background->bounds.x) / backgroundTileSize), 0);
+    int lastColumn = fminf(floorf((view.x + view.width - background->bounds.x) / backgroundTileSize), background->columns - 1);
+    int firstRow = fmaxf(floorf((view.y - background->bounds.y) / backgroundTileSize), 0);
+    int lastRow = fminf(floorf((view.y + view.height - background->bounds.y) / backgroundTileSize), background->rows - 1);
+    
+    for (int row = firstRow; row <= lastRow; row++) {
+        for (int column = firstColumn; column <= lastColumn; column++) {
+            
+            RenderTexture2D tile = background->tiles[row * background->columns + column];
+            
+            //Render textures are stored upside down, a negative height flips them back
+            Rectangle source = {0, 0, tile.texture.width, -tile.texture.height};
+            Vector2 pos = {GetPos(playerPos.x, playerScreenPos.x, background->bounds.x + column*backgroundTileSize), GetPos(playerPos.y, playerScreenPos.y, background->bounds.y + row*backgroundTileSize)};
+            
+            DrawTextureRec(tile.texture, source, pos, WHITE);
+            cullStats->drawn++;
+        }
+    }
+    
+    cullStats->culled = background->columns * background->rows - cullStats->drawn;
+}
+
+void DamageZombie (Bullet* bullets, EntityPool* bulletPool, int currentBullet, int hitZombieIndex, ZombieStore* zombies, EntityPool* zombiePool, ParticleStore* particles, OrbStore* orbs, ZombieType* zombieTypes) {
+    
+    int type = zombies->type[hitZombieIndex];
+    Vector2 zombiePos = GetZombiePos(zombies, hitZombieIndex);
+    
+    zombies->health[hitZombieIndex] -= bullets[currentBullet].damage;
+    bullets[currentBullet].targetsLeft --;
+    Vector2 bulletVel = {bullets[currentBullet].xVel/2, bullets[currentBullet].yVel/2};
+    AddBloodSplatter(particles, zombieTypes[type].color, bulletVel, zombiePos,  zombieTypes[type].size);
+    
+    if (zombies->health[hitZombieIndex] <= 0) {
+        Vector2 zero = {0, 0};
+        AddBloodExplosion(particles, zombieTypes[type].color, zero, zombiePos,  zombieTypes[type].size); 
+        AddExperienceOrbs(orbs, zombiePos, zombieTypes[type].expCount);
+        ResetZombie(zombies, zombiePool, hitZombieIndex);
+    }
+    if (bullets[currentBullet].targetsLeft <= 0) {
+        ResetBullet(bullets, bulletPool, currentBullet);
+    }
+    
+}
+
+void AddColision(Bullet* bullets, EntityPool* bulletPool, int currentBullet, int collisionID, ZombieStore* zombies, EntityPool* zombiePool, ZombieType* zombieTypes, ParticleStore* particles, OrbStore* orbs, LinearArena* arena) {
+    
+    //A zombie is only damaged once per bullet, a new zombie in the same slot has a new handle
+    if (AddToHitSet(&bullets[currentBullet].zombiesHit, GetEntityHandle(zombiePool, collisionID), arena)) {
+        DamageZombie (bullets, bulletPool, currentBullet, collisionID, zombies, zombiePool, particles, orbs, zombieTypes);
+    }
+    
+}
+
+//Insertion sort along the path, zombies entered at the same point go in index order
+void SortBulletHits(BulletHit* hits, int count) {
+    
+    for (int i = 1; i < count; i++) {
+        
+        BulletHit hit = hits[i];
+        int j = i - 1;
+        
+        while (j >= 0 && (hits[j].t > hit.t || (hits[j].t == hit.t && hits[j].zombieIndex > hit.zombieIndex))) {
+            hits[j + 1] = hits[j];
+            j--;
+        }
+        
+        hits[j + 1] = hit;
+    }
+    
+}
+
+//Sweeps the bullet's path over this tick (prevPos to pos) so fast bullets can't skip past zombies between ticks.
+//Only zombies from grid cells touching the path's bounding box are tested, hits are applied in the order the bullet reaches them.
+void CheckHitsAll(Bullet* bullets, EntityPool* bulletPool, int currentBullet, ZombieStore* zombies, EntityPool* zombiePool, ZombieType* zombieTypes, ParticleStore* particles, OrbStore* orbs, LinearArena* arena, ZombieGrid* zombieGrid, float hitQueryRadius, int* nearbyZombies, BulletHit* hits) {
+    PROFILE_SCOPE("CheckHitsAll");
+    
+    Vector2 start = bullets[currentBullet].prevPos;
+    Vector2 end = bullets[currentBullet].pos;
+    
+    float minX = fminf(start.x, end.x) - hitQueryRadius;
+    float minY = fminf(start.y, end.y) - hitQueryRadius;
+    float maxX = fmaxf(start.x, end.x) + hitQueryRadius;
+    float maxY = fmaxf(start.y, end.y) + hitQueryRadius;
+    
+    int nearbyCount = QueryZombieGridRect(zombieGrid, minX, minY, maxX, maxY, nearbyZombies);
+    int hitCount = 0;
+
+    for (int n = 0; n < nearbyCount; n++) {
+        
+        int i = nearbyZombies[n];
+        float t;
+        
+        //Zombies killed earlier this frame are still in the grid
+        if (IsEntityActive(zombiePool, i) && SweepBulletZombie(start, end, zombies, i, &t)) {
+            hits[hitCount].t = t;
+            hits[hitCount].zombieIndex = i;
+            hitCount++;
+        }
+        
+    }
+    
+    SortBulletHits(hits, hitCount);
+    
+    for (int n = 0; n < hitCount; n++) {
+        
+        AddColision(bullets, bulletPool, currentBullet, hits[n].zombieIndex, zombies, zombiePool, zombieTypes, particles, orbs, arena);
+        
+        if (!IsEntityActive(bulletPool, currentBullet)) {
+            return;
+        }
+        
+    }
+    
+}
+
+void ShowDeathScreen() {    
+    DrawRectangle(screenWidth/2 - 100 ,screenHeight/2 - 12, 200, 50, RAYWHITE);
+    DrawText("YOU DIED", screenWidth/2 - 75 ,screenHeight/2, 30, BLACK);    
+}
+
+void InitHudWidget(HudWidget* widget, int width, int height) {
+    widget->texture = LoadRenderTexture(width, height);
+    widget->shown[0] = INT_MIN;
+    widget->shown[1] = INT_MIN;
+}
+
+//Returns true when the widget has to be redrawn into its texture, and remembers the values as shown
+bool UpdateHudWidget(HudWidget* widget, int first, int second) {
+    
+    if (widget->shown[0] == first && widget->shown[1] == second) {
+        return(false);
+    }
+    
+    widget->shown[0] = first;
+    widget->shown[1] = second;
+    return(true);
+}
+
+void DrawHudWidget(HudWidget* widget, Vector2 pos) {
+    
+    //Render textures are stored upside down, a negative height flips them back
+    Rectangle source = {0, 0, widget->texture.texture.width, -widget->texture.texture.height};
+    DrawTextureRec(widget->texture.texture, source, pos, WHITE);
+}
+
+const int healthBarWidth = 120;
+const int healthBarHeight = 15;
+const int healthBarMargin = 30;
+const int healthBarBorder = 6;
+
+const int expBarBorder = 6;
+const int expBarHeight = 16;
+
+void DrawPlayerHealthBar(HudWidget* widget, double playerHealth, Vector2 playerScreenPos) {
+    
+    Color remainingHealthColor = GREEN;
+    Color baseColor = RED;
+    
+    int remainingHealthWidth = healthBarWidth * (playerHealth/playerMaxHealth);
+    
+    if (UpdateHudWidget(widget, remainingHealthWidth, 0)) {
+        
+        BeginTextureMode(widget->texture);
+        DrawRectangle(0, 0, healthBarWidth + healthBarBorder, healthBarHeight + healthBarBorder, BLACK);
+        DrawRectangle(healthBarBorder/2, healthBarBorder/2, healthBarWidth, healthBarHeight, baseColor);
+        DrawRectangle(healthBarBorder/2, healthBarBorder/2, remainingHealthWidth, healthBarHeight, remainingHealthColor);
+        EndTextureMode();
+    }
+    
+    Vector2 pos = {playerScreenPos.x - healthBarWidth/2 - healthBarBorder/2, playerScreenPos.y + healthBarHeight + healthBarMargin - healthBarBorder/2};
+    DrawHudWidget(widget, pos);
+
+}
+
+void DrawPlayerExpBar(HudWidget* widget, double currentPlayerExp, double neededPlayerExp, int playerLevel) {
+    
+    int expBarWidth = screenWidth-expBarBorder*2;
+    int lvlTextSize = 15;
+
+    Color remainingExpColor = GOLD;
+    Color baseColor = GRAY;
+    
+    int remainingExpWidth = expBarWidth * (currentPlayerExp/neededPlayerExp);
+    
+    if (UpdateHudWidget(widget, remainingExpWidth, playerLevel)) {
+        
+        //Drawn with the top left of the border at 0, 0, the level text can run to the edge of the screen
+        int barX = expBarBorder/2;
+        int barY = expBarBorder/2;
+        int textY = barY + expBarHeight/2 - lvlTextSize/2;
+        
+        char level[16];
+        sprintf(level, "%d", playerLevel);
+        
+        BeginTextureMode(widget->texture);
+        ClearBackground(BLANK);
+        DrawRectangle(0, 0, expBarWidth + expBarBorder, expBarHeight + expBarBorder, BLACK);
+        DrawRectangle(barX, barY, expBarWidth, expBarHeight, baseColor);
+        DrawRectangle(barX, barY, remainingExpWidth, expBarHeight, remainingExpColor);
+        DrawText("Lvl.", screenWidth - 45 - expBarBorder/2, textY, lvlTextSize, BLACK);
+        DrawText(level, screenWidth - 20 - expBarBorder/2, textY, lvlTextSize, BLACK);
+        EndTextureMode();
+    }
+    
+    Vector2 pos = {expBarBorder/2, expBarBorder/2};
+    DrawHudWidget(widget, pos);
+    
+}
+
+bool ArrayContainsNumber(int arr[], int length, int number) {
+    for (int i = 0; i < length; i++) {
+        if (arr[i] == number) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int GetUpgrade(int* currentUpgrades, int* gunsRollTickets, int upgradesCount) {
+    
+    int totalStatsForWeapons = 7; 
+
+    int totalTickets = 0; 
+    for (int i = 0; i < totalStatsForWeapons; i++) {
+        totalTickets += gunsRollTickets[i];
+    }
+    
+    while(true) {
+        
+        int upgradeNum = GenerateRandInt(totalTickets);
+        
+        for (int i = 0; i < totalStatsForWeapons; i++) {
+            
+            upgradeNum -= gunsRollTickets[i];
+            
+            if (upgradeNum <= 0 && !ArrayContainsNumber(currentUpgrades, upgradesCount, i)) {
+                
+                return(i);
+                
+            }
+            
+        }
+        
+    }
+    
+}
+
+//Fills chosenUpgrades with upgradesCount different upgrades
+void GetPlayerUpgrades(int* chosenUpgrades, int upgradesCount, int* gunsRollTickets) {
+    
+    for (int i = 0; i < upgradesCount; i++) {
+       
+        chosenUpgrades[i] = GetUpgrade(chosenUpgrades, gunsRollTickets, i);
+    }
+    
+}
+
+const int upgradeCardWidth = 300;
+const int upgradeCardHeight = 450;
+
+//The longest upgrade names run past the right edge of the card
+const int upgradeCardOverhang = 150;
+
+Rectangle GetUpgradeRectangle(int i, int upgradesCount) {
+    
+    int width = upgradeCardWidth;
+    int height = upgradeCardHeight;
+
+    Vector2 pos;
+    
+    pos.x = (screenWidth/upgradesCount * i + (width/upgradesCount)/2);
+    pos.y = (screenHeight/2 - height/2);
+    
+    Rectangle rec = {pos.x, pos.y, width, height};
+    
+    return rec;
+    
+}
+
+//The array is only good until the frame arena is reset
+Rectangle* GetUpgradeRectangles(LinearArena* frameArena, int upgradesCount) {
+    
+    Rectangle* upgradesRectangles = PushLinearArena(frameArena, upgradesCount * sizeof(Rectangle));
+    
+    for (int i = 0; i < upgradesCount; i++) {
+        upgradesRectangles[i] = GetUpgradeRectangle(i, upgradesCount);
+    }
+    
+    return(upgradesRectangles);
+    
+}
+
+void WriteUpgradeDetails(Rectangle rec, int chosenUpgrade) {
+    
+    int fontSize = 30;
+    
+    char upgradeNum[BUFSIZ];
+    sprintf(upgradeNum, "%d", chosenUpgrade);
+    
+    DrawText(upgradeNum, rec.x + 3, rec.y, fontSize, BLACK);
+    DrawText(upgradeNum, rec.x + rec.width - fontSize/2 - 3, rec.y + rec.height - fontSize + 2, fontSize, BLACK);
+    
+    if (chosenUpgrade == 0) {
         DrawText("Bullet Count", rec.x + rec.width/4, rec.y + rec.height/2, fontSize, BLACK);  
     } else if (chosenUpgrade == 1) {
         DrawText("Gun RPM", rec.x + rec.width/4, rec.y + rec.height/2, fontSize, BLACK); 
@@ -957,368 +3663,1530 @@ void WriteUpgradeDetails(Rectangle rec, int chosenUpgrade) {
 
 }
 
-void DrawPlayerUpgrades(int* chosenUpgrades, int upgradesCount) {
+//Each card is redrawn only when a new upgrade lands in its slot
+void DrawPlayerUpgrades(HudWidget* cards, LinearArena* frameArena, int* chosenUpgrades, int upgradesCount) {
+    
+    Color color = LIGHTGRAY;
+    Rectangle card = {0, 0, upgradeCardWidth, upgradeCardHeight};
+    Rectangle* upgradesRectangles = GetUpgradeRectangles(frameArena, upgradesCount);
+    
+    for (int i = 0; i < upgradesCount; i++) {
+        
+        if (UpdateHudWidget(&cards[i], chosenUpgrades[i], 0)) {
+            BeginTextureMode(cards[i].texture);
+            ClearBackground(BLANK);
+            DrawRectangleRec(card, color);
+            WriteUpgradeDetails(card, chosenUpgrades[i]);
+            EndTextureMode();
+        }
+        
+        Vector2 pos = {upgradesRectangles[i].x, upgradesRectangles[i].y};
+        DrawHudWidget(&cards[i], pos);
+     
+    }
+    
+}
+
+void DoUpgrade(int chosenUpgrade, int playerBonusStatsIndex, Gun* guns) {
+    
+    /*
+    int bulletCount;
+    int rpm;
+    double damage;
+    int penetration;
+    double speed;
+    int bulletSize;
+    double accuracy; 
+    */
+    
+    int bulletCountPlus = 1;
+    int rpmPlus = 60;
+    double damagePlus = 5;
+    int penetrationPlus = 1;
+    double speedPlus = 100;
+    int bulletSizePlus = 2;
+    double accuracyPlus = 4;
+    
+    if (chosenUpgrade == 0) {
+        guns[playerBonusStatsIndex].bulletCount += bulletCountPlus;
+    } else if (chosenUpgrade == 1) {
+        guns[playerBonusStatsIndex].rpm += rpmPlus;
+    } else if (chosenUpgrade == 2) {
+        guns[playerBonusStatsIndex].damage += damagePlus;
+    } else if (chosenUpgrade == 3) {
+        guns[playerBonusStatsIndex].penetration += penetrationPlus;
+    } else if (chosenUpgrade == 4) {
+        guns[playerBonusStatsIndex].speed += speedPlus;
+    } else if (chosenUpgrade == 5) {
+        guns[playerBonusStatsIndex].bulletSize += bulletSizePlus;
+    } else if (chosenUpgrade == 6) {
+        guns[playerBonusStatsIndex].accuracy += accuracyPlus;
+    }  
+    
+}
+
+//Returns the index of the upgrade card under the mouse, or -1
+int CheckUpgradeHitboxes(LinearArena* frameArena, int upgradesCount, Vector2 mousePosition) {
+    
+    Rectangle* upgradesRectangles = GetUpgradeRectangles(frameArena, upgradesCount);
+    
+    for (int i = 0; i < upgradesCount; i++) {
+        
+        if (CheckCollisionPointRec(mousePosition, upgradesRectangles[i])) {
+            
+            return(i);
+            
+        }
+     
+    }
+    
+    return(-1);
+    
+} 
+
+
+
+
+void InitZombieTypes(ZombieType* zombieTypes) {
+    
+    ZombieType types[4] = {
+        //Normal
+        {0, 100, 3, zDefSize, zDefMoveSpeed, zDefDamage, zDefHealth, zDefAttackDelay, GREEN},
+        
+        //Strong
+        {2, 10, 6, zDefSize*1.5, zDefMoveSpeed*0.9, zDefDamage*2, zDefHealth*4, zDefAttackDelay*1.5, RED}, 
+        
+        //Fast
+        {4, 10, 3, zDefSize*0.8, zDefMoveSpeed*2, zDefDamage, zDefHealth*0.6, zDefAttackDelay*0.7, BLUE},
+        
+        //Giant
+        {6, 2, 20, zDefSize*3.5, zDefMoveSpeed*0.7, zDefDamage*3.5, zDefHealth*10, zDefAttackDelay*5, PURPLE}
+        
+    };
+    
+    memcpy(zombieTypes, types, sizeof(types));
+    
+}
+
+void InitGuns(Gun* guns, int* gunsRollTickets) {
+    
+    Gun gunTypes[7] = {
+        /*
+        int bulletCount;
+        int rpm;
+        double damage;
+        int penetration;
+        double speed;
+        int bulletSize;
+        double accuracy; 
+        */
+        
+        //PlayerBonusStats
+        {0, 0, 0, 0, 0, 0, 0},
+        
+        //Pistol        
+        {1, 200, 20.0, 1, 800.0, 10, 20},
+        //shotgun
+        {15, 200, 20, 1, 800.0, 6, 4},
+        //shotgun 2
+        {45, 500, 2, 1, 800.0, 8, 3.5},
+        //sniper
+        {1, 80, 100, 10, 1500.0, 15, 100},
+        //minigun
+        {1, 2500, 12, 1, 800.0, 8, 10},
+        //obliteration
+        {360, 100, 100, 2, 100, 100, 0.55}
+        
+    };
+    
+    int rollTickets[7] = {1, 3, 6, 2, 3, 0, 6};
+    
+    memcpy(guns, gunTypes, sizeof(gunTypes));
+    memcpy(gunsRollTickets, rollTickets, sizeof(rollTickets));
+    
+}
+
+//Movement benchmark: the old array of structs MoveZombie against the store and kernels
+void MoveZombieAoS(Zombie* zombies, int zombieIndex, Vector2 playerPos, ZombieType* zombieTypes, ZombieGrid* zombieGrid, int* nearbyZombies, float frameTime, bool separation) {
+    float v = GetAngle(zombies[zombieIndex].pos, playerPos);
+    
+    double xChange = CalcCos(v, zombieTypes[zombies[zombieIndex].type].speed);
+    double yChange = CalcSin(v, zombieTypes[zombies[zombieIndex].type].speed);
+    
+    int nearbyCount = separation ? QueryZombieGrid(zombieGrid, zombies[zombieIndex].pos, zViewDistance, nearbyZombies) : 0;
+    
+    for (int n = 0; n < nearbyCount; n++) {
+        
+        int i = nearbyZombies[n];
+        
+        if (i != zombieIndex) {
+            
+            double cDist = GetDistance(zombies[i].pos, zombies[zombieIndex].pos);
+
+            if (cDist < zViewDistance && cDist > 0) { 
+                float xDist = zombies[i].pos.x - zombies[zombieIndex].pos.x;
+                float yDist = zombies[i].pos.y - zombies[zombieIndex].pos.y;
+                xChange += xDist*zSeparation/cDist;
+                yChange += yDist*zSeparation/cDist;
+            }
+        }
+    }
+    
+    Vector2 zTarget = {xChange, yChange};
+    Vector2 self = {0, 0};
+    
+    v = GetAngle(zTarget, self);
+
+
+    zombies[zombieIndex].pos.x -= (xChange*frameTime);
+    zombies[zombieIndex].pos.y -= (yChange*frameTime);
+    zombies[zombieIndex].direction = v;
+
+}
+
+void MoveZombiesSeekOnly(ZombieStore* zombies, EntityPool* zombiePool, Vector2 playerPos, float frameTime) {
+    
+    int count = RoundUpToZombieLanes(zombiePool->slotsUsed);
+    
+    SeekPlayerKernel(zombies, count, playerPos);
+    IntegrateZombiesKernel(zombies, count, frameTime);
+    
+}
+
+int BenchmarkZombieMovement(int ticks, int workerCount) {
+    
+    srand(1);
+    
+    ZombieType zombieTypes[4];
+    InitZombieTypes(zombieTypes);
+    
+    Vector2 playerPos = {0, 0};
+    float frameTime = 1.0f/fps;
+    
+    EntityArena arena;
+    InitEntityArena(&arena);
+    ZombieStore zombies;
+    InitZombieStore(&zombies, &arena, benchZombieCount, benchZombieCount);
+    EntityPool zombiePool;
+    InitEntityPool(&zombiePool, &arena, benchZombieCount, benchZombieCount);
+    Zombie* aosZombies = malloc(benchZombieCount * sizeof(Zombie));
+    Vector2* startPos = malloc(benchZombieCount * sizeof(Vector2));
+    
+    //A full wave in a ring around the player
+    for (int n = 0; n < benchZombieCount; n++) {
+        
+        int i = AllocateEntity(&zombiePool);
+        int type = GenerateRandInt(zombieTypesCount);
+        float angle = GenerateRandInt(3600) / 10.0f;
+        float distance = 200 + GenerateRandInt(800);
+        
+        startPos[i].x = CalcCos(angle, distance);
+        startPos[i].y = CalcSin(angle, distance);
+        
+        zombies.type[i] = type;
+        zombies.speed[i] = zombieTypes[type].speed;
+        zombies.size[i] = zombieTypes[type].size;
+        aosZombies[i].type = type;
+    }
+    
+    ZombieGrid zombieGrid;
+    InitZombieGrid(&zombieGrid, &arena, zombies.maxCapacity);
+    JobSystem jobs;
+    InitJobSystem(&jobs, workerCount);
+    int* nearbyZombies = ReserveEntityArray(&arena, sizeof(int), jobs.workerCount * zombies.maxCapacity, jobs.workerCount * zombies.maxCapacity);
+    const char* modeNames[3] = {"seek only", "seek + separation", "separation threaded"};
+    
+    printf("Zombie movement, %d zombies, %d ticks, %d workers (grid built once, not timed)\n", benchZombieCount, ticks, jobs.workerCount);
+    
+    //The threaded row compares against the same AoS loop so its speedup includes the threads
+    for (int mode = 0; mode <= 2; mode++) {
+        
+        bool separation = (mode > 0);
+        
+        for (int i = 0; i < benchZombieCount; i++) {
+            aosZombies[i].pos = startPos[i];
+            zombies.x[i] = startPos[i].x;
+            zombies.y[i] = startPos[i].y;
+        }
+        BuildZombieGrid(&zombieGrid, &zombies, &zombiePool);
+        
+        double start = GetMonotonicTime();
+        for (int tick = 0; tick < ticks; tick++) {
+            for (int n = 0; n < zombiePool.activeCount; n++) {
+                MoveZombieAoS(aosZombies, zombiePool.activeSlots[n], playerPos, zombieTypes, &zombieGrid, nearbyZombies, frameTime, separation);
+            }
+        }
+        double aosTime = (GetMonotonicTime() - start) / ticks;
+        
+        start = GetMonotonicTime();
+        for (int tick = 0; tick < ticks; tick++) {
+            if (separation) {
+                MoveAllZombies(&zombies, &zombiePool, &zombieGrid, NULL, (mode == 2) ? &jobs : NULL, nearbyZombies, playerPos, tick, false, frameTime);
+            } else {
+                MoveZombiesSeekOnly(&zombies, &zombiePool, playerPos, frameTime);
+            }
+        }
+        double soaTime = (GetMonotonicTime() - start) / ticks;
+        
+        //The store steers from start of frame positions, the old path from already moved neighbours
+        double maxDifference = 0;
+        for (int i = 0; i < benchZombieCount; i++) {
+            Vector2 soaPos = {zombies.x[i], zombies.y[i]};
+            double difference = GetDistance(soaPos, aosZombies[i].pos);
+            if (difference > maxDifference) {
+                maxDifference = difference;
+            }
+        }
+        
+        printf("%-22s AoS %8.3f ms/tick   SoA %8.3f ms/tick   speedup %5.2fx   max position difference %.4f px\n", modeNames[mode], aosTime*1000, soaTime*1000, aosTime/soaTime, maxDifference);
+    }
+    
+    free(aosZombies);
+    free(startPos);
+    free(zombieGrid.cellStart);
+    FreeJobSystem(&jobs);
+    FreeEntityArena(&arena);
+    
+    return 0;
+}
+
+//Per zombie seek, facing and attack range test, the degree and double helpers against the vector ones
+int BenchmarkVectorMath(int ticks) {
+    
+    srand(1);
+    
+    Vector2 playerPos = {0, 0};
+    float speed = zDefMoveSpeed;
+    float reach = zDefSize + 0.5f;
+    
+    Vector2* positions = malloc(benchZombieCount * sizeof(Vector2));
+    Vector2* oldSteering = malloc(benchZombieCount * sizeof(Vector2));
+    Vector2* newSteering = malloc(benchZombieCount * sizeof(Vector2));
+    float* oldFacing = malloc(benchZombieCount * sizeof(float));
+    int oldHits = 0;
+    int newHits = 0;
+    
+    for (int i = 0; i < benchZombieCount; i++) {
+        float angle = GenerateRandInt(3600) / 10.0f;
+        float distance = GenerateRandInt(1000);
+        positions[i].x = CalcCos(angle, distance);
+        positions[i].y = CalcSin(angle, distance);
+    }
+    
+    double start = GetMonotonicTime();
+    for (int tick = 0; tick < ticks; tick++) {
+        for (int i = 0; i < benchZombieCount; i++) {
+            float v = GetAngle(positions[i], playerPos);
+            oldSteering[i].x = CalcCos(v, speed);
+            oldSteering[i].y = CalcSin(v, speed);
+            
+            Vector2 self = {0, 0};
+            oldFacing[i] = GetAngle(oldSteering[i], self);
+            oldHits += GetDistance(positions[i], playerPos) < reach;
+        }
+    }
+    double oldTime = (GetMonotonicTime() - start) / ((double)ticks * benchZombieCount);
+    
+    //The facing is left in the steering vector until a zombie is drawn
+    start = GetMonotonicTime();
+    for (int tick = 0; tick < ticks; tick++) {
+        for (int i = 0; i < benchZombieCount; i++) {
+            Vector2 toZombie = V2Sub(positions[i], playerPos);
+            newSteering[i] = V2Scale(V2Normalize(toZombie), speed);
+            newHits += V2LengthSqr(toZombie) < reach*reach;
+        }
+    }
+    double newTime = (GetMonotonicTime() - start) / ((double)ticks * benchZombieCount);
+    
+    double maxDifference = 0;
+    for (int i = 0; i < benchZombieCount; i++) {
+        double difference = sqrt(V2DistanceSqr(oldSteering[i], newSteering[i]));
+        if (difference > maxDifference) {
+            maxDifference = difference;
+        }
+    }
+    
+    printf("Zombie seek + facing + attack range, %d zombies, %d ticks\n", benchZombieCount, ticks);
+    printf("degrees and doubles %7.2f ns/zombie   vectors %7.2f ns/zombie   speedup %5.2fx   max steering difference %.5f px/s   hits %d/%d\n", oldTime*1e9, newTime*1e9, oldTime/newTime, maxDifference, oldHits, newHits);
+    
+    free(positions);
+    free(oldSteering);
+    free(newSteering);
+    free(oldFacing);
+    
+    return 0;
+}
+
+
+
+
+void InitGameState(GameState* state, JobSystem* jobs, const GameConfig* config) {
+    
+    //Creating map walls
+    state->mapWalls[0].x = -mapWidth/2+playerSize/2;
+    state->mapWalls[0].y = mapHeight/2+playerSize/2;
+    
+    state->mapWalls[1].x = mapWidth/2+playerSize/2;
+    state->mapWalls[1].y = mapHeight/2+playerSize/2;
+    
+    state->mapWalls[2].x = mapWidth/2+playerSize/2;
+    state->mapWalls[2].y = -mapHeight/2+playerSize/2;
+    
+    state->mapWalls[3].x = -mapWidth/2+playerSize/2;
+    state->mapWalls[3].y = -mapHeight/2+playerSize/2;
+    
+    InitZombieTypes(state->zombieTypes);
+    InitGuns(state->guns, state->gunsRollTickets);
+    
+    state->wave = 1;
+    state->spawnedZombieCount = 0;
+    state->lastZombieSpawnTime = 0.0;
+    
+    //Bullets only need to check zombies whose rectangle can reach them
+    state->hitQueryRadius = 0;
+    for (int i = 0; i < zombieTypesCount; i++) {
+        if (state->zombieTypes[i].size/2.0f > state->hitQueryRadius) {
+            state->hitQueryRadius = state->zombieTypes[i].size/2.0f;
+        }
+    }
+    
+    InitEntityArena(&state->arena);
+    InitLinearArena(&state->persistentArena, persistentArenaBytes);
+    InitLinearArena(&state->frameArena, frameArenaBytes);
+    InitZombieStore(&state->zombies, &state->arena, zombieChunkSize, config->zombieCapacity);
+    InitEntityPool(&state->zombiePool, &state->arena, zombieChunkSize, config->zombieCapacity);
+    InitZombieGrid(&state->zombieGrid, &state->arena, state->zombies.maxCapacity);
+    InitFlowField(&state->flowField);
+    state->jobs = jobs;
+    int workerCount = (jobs != NULL) ? jobs->workerCount : 1;
+    state->nearbyZombies = ReserveEntityArray(&state->arena, sizeof(int), workerCount * state->zombies.maxCapacity, workerCount * state->zombies.maxCapacity);
+    
+    state->bullets = ReserveEntityArray(&state->arena, sizeof(Bullet), config->bulletCapacity, 0);
+    InitEntityPool(&state->bulletPool, &state->arena, 0, config->bulletCapacity);
+    GrowBullets(state->bullets, &state->bulletPool, GetGrownCapacity(0, config->bulletCapacity, bulletChunkSize));
+    state->bulletHits = ReserveEntityArray(&state->arena, sizeof(BulletHit), state->zombies.maxCapacity, state->zombies.maxCapacity);
+    
+    state->currentGun = 1;
+    state->playerBonusStatsIndex = 0;
+    state->lastShotTime = 0.0;
+    
+    state->mapDetails = PushLinearArena(&state->persistentArena, environmentDetailLimit * sizeof(MapDetail));
+    state->detailRandomizer = GenerateRandInt(1000);
+    for (int i = 0; i < environmentDetailLimit; i++){
+        GenerateDetail(state->mapDetails, i);
+    }
+    
+    InitParticleStore(&state->particles, &state->arena, particleChunkSize, config->particleCapacity);
+    InitOrbStore(&state->orbs, &state->arena, orbChunkSize, maxOrbCount);
+    
+    state->playerPos.x = 0;
+    state->playerPos.y = 0;
+    state->prevPlayerPos = state->playerPos;
+    state->playerRotation = 0.0f;
+    state->playerHealth = playerMaxHealth;
+    
+    state->playerLevel = 1;
+    state->playerExp = 0;
+    state->neededPlayerExp = state->playerLevel * expPerLevel;
+    state->playerDead = 0;
+    
+    state->upgradeTime = 0;
+    state->upgradesCount = 3;
+    state->upgradesPointer = PushLinearArena(&state->persistentArena, state->upgradesCount * sizeof(int));
+    
+    InitGameClock(&state->clock);
+    state->tick = 0;
+    
+}
+
+void FreeGameState(GameState* state) {
+    
+    //Zombies, bullets, particles, their pools and per-zombie scratch arrays
+    FreeEntityArena(&state->arena);
+    
+    //Map detail, upgrade choices and bullet hit tables
+    FreeLinearArena(&state->persistentArena);
+    FreeLinearArena(&state->frameArena);
+    
+    free(state->zombieGrid.cellStart);
+    FreeFlowField(&state->flowField);
+    
+}
+
+void MovePlayer(GameState* state, SimInput* input, float frameTime) {
     
-    Color color = LIGHTGRAY;
+    float currentMoveSpeed = moveSpeed*frameTime;
+   
+    Vector2 move = {0, 0};
+    
+    if (input->right) {
+        move.x += 1; 
+    }
+    if (input->left) {
+        move.x -= 1;
+    }
+    if (input->up) {
+        move.y -= 1;
+    }
+    if (input->down) {
+        move.y += 1; 
+    }
     
-    Rectangle *upgradesRectangles = malloc(upgradesCount * sizeof(Rectangle));
+    //Diagonals are as fast as straight lines
+    if (move.x != 0 || move.y != 0) {
+        state->playerPos = V2Add(state->playerPos, V2Scale(V2Normalize(move), currentMoveSpeed));
+    }
     
-    for (int i = 0; i < upgradesCount; i++) {
-       
-        upgradesRectangles[i] = GetUpgradeRectangle(i, upgradesCount);
-        DrawRectangleRec(upgradesRectangles[i], color);
-        WriteUpgradeDetails(upgradesRectangles[i], chosenUpgrades[i]);
-     
+    if (state->playerPos.x > mapWidth/2) {
+        state->playerPos.x = mapWidth/2;
+    } else if (state->playerPos.x < -mapWidth/2+playerSize){
+        state->playerPos.x = -mapWidth/2+playerSize;
+    }
+    
+    if (state->playerPos.y > mapHeight/2) {
+        state->playerPos.y = mapHeight/2;
+    } else if (state->playerPos.y < -mapHeight/2+playerSize){
+        state->playerPos.y = -mapHeight/2+playerSize;
+    }
+    
+}
+
+//Positions from before this tick, drawing interpolates from them to the current ones
+void SavePreviousPositions(GameState* state) {
+    
+    state->prevPlayerPos = state->playerPos;
+    
+    int zombieSlots = state->zombiePool.slotsUsed;
+    memcpy(state->zombies.prevX, state->zombies.x, zombieSlots * sizeof(float));
+    memcpy(state->zombies.prevY, state->zombies.y, zombieSlots * sizeof(float));
+    
+    for (int n = 0; n < state->bulletPool.activeCount; n++) {
+        int i = state->bulletPool.activeSlots[n];
+        state->bullets[i].prevPos = state->bullets[i].pos;
+    }
+    
+    memcpy(state->particles.prevX, state->particles.x, state->particles.count * sizeof(float));
+    memcpy(state->particles.prevY, state->particles.y, state->particles.count * sizeof(float));
+    memcpy(state->orbs.prevX, state->orbs.x, state->orbs.count * sizeof(float));
+    memcpy(state->orbs.prevY, state->orbs.y, state->orbs.count * sizeof(float));
+    
+}
+
+//Advances the session by frameTime seconds, no window or raylib input is needed
+void SimulationStep(GameState* state, SimInput* input, float frameTime) {
+    PROFILE_SCOPE("SimulationStep");
+    
+    SavePreviousPositions(state);
+    memset(state->phaseTime, 0, sizeof(state->phaseTime));
+    
+    //Cooldowns, spawn timers and particle lifetimes stand still on the upgrade and death screens
+    SetGameClockPaused(&state->clock, state->upgradeTime == 1 || state->playerDead == 1);
+    AdvanceGameClock(&state->clock, frameTime);
+    state->tick++;
+    double currentTime = state->clock.now;
+    
+    //if player is alive
+    if (state->playerDead == 0 && state->upgradeTime == 0) {
+        
+        //Player rotation comes from the mouse
+        state->playerRotation = input->aimRotation;
+        
+        if (input->shoot) {
+            state->lastShotTime = Shoot(state->guns, state->currentGun, state->lastShotTime, state->bullets, &state->bulletPool, state->playerPos, state->playerRotation, state->playerBonusStatsIndex, currentTime);
+        }
+        
+        MovePlayer(state, input, frameTime);
+        
+        //Heal player
+        state->playerHealth += playerHealingPerSec * frameTime;
+        if (state->playerHealth > playerMaxHealth) {
+            
+            state->playerHealth = playerMaxHealth;
+            
+        } else if (state->playerHealth <= 0) {
+            
+            state->playerDead = 1;
+            
+        }
+        
+        //Check lvlUp
+        if (state->playerExp > state->neededPlayerExp) {
+            
+            state->playerExp -= state->neededPlayerExp;
+            state->playerLevel += 1;
+            state->neededPlayerExp =  state->playerLevel * expPerLevel;
+            
+            state->upgradeTime = 1;
+            GetPlayerUpgrades(state->upgradesPointer, state->upgradesCount, state->gunsRollTickets);
+        }
+        
+        
+        
+        //Zomibe alive check
+        double phaseStart = GetMonotonicTime();
+        int targetZombieCount = difficulty*state->wave;
+
+        if (targetZombieCount != state->spawnedZombieCount) {
+            double oldLastZombieSpawnTime = state->lastZombieSpawnTime;
+            
+            state->lastZombieSpawnTime = CreateZombie(&state->zombies, &state->zombiePool, state->zombieTypes, state->wave, state->lastZombieSpawnTime, currentTime);
+            
+            if (oldLastZombieSpawnTime != state->lastZombieSpawnTime) {
+                state->spawnedZombieCount++;
+            }
+        }
+        
+        double phaseEnd = GetMonotonicTime();
+        state->phaseTime[phaseSpawn] = phaseEnd - phaseStart;
+        phaseStart = phaseEnd;
+        
+        BuildZombieGrid(&state->zombieGrid, &state->zombies, &state->zombiePool);
+        BuildFlowField(&state->flowField, state->playerPos);
+        
+        MoveAllZombies(&state->zombies, &state->zombiePool, &state->zombieGrid, &state->flowField, state->jobs, state->nearbyZombies, state->playerPos, state->tick, true, frameTime);
+        
+        phaseEnd = GetMonotonicTime();
+        state->phaseTime[phaseZombieMove] = phaseEnd - phaseStart;
+        phaseStart = phaseEnd;
+        
+        ZombieAttackAll(&state->zombies, &state->zombiePool, state->jobs, state->playerPos, state->zombieTypes, &state->playerHealth, currentTime);
+        
+        phaseEnd = GetMonotonicTime();
+        state->phaseTime[phaseAttack] = phaseEnd - phaseStart;
+        phaseStart = phaseEnd;
+        
+        int aliveZombies = state->zombiePool.activeCount;
+        
+        if (aliveZombies == 0 && targetZombieCount == state->spawnedZombieCount) {
+            state->wave++;
+            state->spawnedZombieCount = 0;
+        } 
+        
+        MoveAllParticles(&state->particles, frameTime);
+        state->playerExp += MoveAllOrbs(&state->orbs, state->playerPos, frameTime) * expPerExp;
+        
+        phaseEnd = GetMonotonicTime();
+        state->phaseTime[phaseParticles] = phaseEnd - phaseStart;
+        phaseStart = phaseEnd;
+        
+        BuildZombieGrid(&state->zombieGrid, &state->zombies, &state->zombiePool);
+        
+        //Backwards since bullets are released while iterating
+        PROFILE_SCOPE("Bullets");
+        for (int n = state->bulletPool.activeCount - 1; n >= 0; n--) {
+            int i = state->bulletPool.activeSlots[n];
+            MoveBullet(state->bullets, &state->bulletPool, i, state->playerPos, frameTime);
+            
+            if (IsEntityActive(&state->bulletPool, i)) {
+                CheckHitsAll(state->bullets, &state->bulletPool, i, &state->zombies, &state->zombiePool, state->zombieTypes, &state->particles, &state->orbs, &state->persistentArena, &state->zombieGrid, state->hitQueryRadius, state->nearbyZombies, state->bulletHits);
+            }
+        }
+        
+        state->phaseTime[phaseBullets] = GetMonotonicTime() - phaseStart;
+        
+    } else if (state->upgradeTime == 1) {
+        
+        if (input->upgradePick >= 0 && input->upgradePick < state->upgradesCount) {
+            
+            DoUpgrade(state->upgradesPointer[input->upgradePick], state->playerBonusStatsIndex, state->guns);
+            state->upgradeTime = 0;
+            
+        }
+        
+    }
+    
+}
+
+//alpha is how far the frame is between the previous and the current tick
+void DrawCullStats(RenderState* render) {
+    
+    const char* names[4] = {"Background", "Particles", "Bullets", "Zombies"};
+    CullStats* stats[4] = {&render->backgroundCull, &render->particleCull, &render->bulletCull, &render->zombieCull};
+    char text[BUFSIZ];
+    
+    for (int i = 0; i < 4; i++) {
+        sprintf(text, "%-10s drawn %5d  culled %5d", names[i], stats[i]->drawn, stats[i]->culled);
+        DrawText(text, 10, 30 + i*20, 18, BLACK);
+    }
+    
+}
+
+//Batches hold the most vertices a full store can need, so nothing is allocated while drawing.
+//Bakes the background, so the window has to be open.
+void InitRenderState(RenderState* render, GameState* state) {
+    
+    InitDrawBatch(&render->zombieBatch, state->zombies.maxCapacity * 8);
+    InitDrawBatch(&render->bulletBatch, state->bulletPool.maxCapacity * 3);
+    InitDrawBatch(&render->particleBatch, state->particles.maxCapacity * particleCircleSegments * 3);
+    InitDrawBatch(&render->orbBatch, state->orbs.maxCapacity * particleCircleSegments * 3);
+    
+    for (int i = 0; i <= particleCircleSegments; i++) {
+        float angle = i * (2*PI/particleCircleSegments);
+        render->circlePoints[i].x = cosf(angle);
+        render->circlePoints[i].y = sinf(angle);
+    }
+    
+    BakeBackground(&render->background, state->mapDetails, state->detailRandomizer);
+    
+    InitHudWidget(&render->hud.expBar, screenWidth - expBarBorder/2, expBarHeight + expBarBorder);
+    InitHudWidget(&render->hud.healthBar, healthBarWidth + healthBarBorder, healthBarHeight + healthBarBorder);
+    for (int i = 0; i < 3; i++) {
+        InitHudWidget(&render->hud.upgradeCards[i], upgradeCardWidth + upgradeCardOverhang, upgradeCardHeight);
+    }
+    
+    render->showCullStats = false;
+    
+}
+
+void FreeRenderState(RenderState* render) {
+    free(render->zombieBatch.vertices);
+    free(render->bulletBatch.vertices);
+    free(render->particleBatch.vertices);
+    free(render->orbBatch.vertices);
+    FreeBackground(&render->background);
+    
+    UnloadRenderTexture(render->hud.expBar.texture);
+    UnloadRenderTexture(render->hud.healthBar.texture);
+    for (int i = 0; i < 3; i++) {
+        UnloadRenderTexture(render->hud.upgradeCards[i].texture);
+    }
+}
+
+void DrawGame(GameState* state, RenderState* render, Vector2 playerScreenPos, float alpha) {
+    PROFILE_SCOPE("DrawGame");
+    
+    Vector2 playerPos = LerpPos(state->prevPlayerPos, state->playerPos, alpha);
+    Vector2 playerOffset = {playerSize/2, playerSize/2};
+    
+    Rectangle view = GetViewRect(playerPos, playerScreenPos);
+    CullStats emptyStats = {0, 0};
+    render->backgroundCull = emptyStats;
+    render->particleCull = emptyStats;
+    render->bulletCull = emptyStats;
+    render->zombieCull = emptyStats;
+    
+    ClearBackground(LIME);
+    
+    DrawBackground(&render->background, playerPos, playerScreenPos, view, &render->backgroundCull);
+    
+    DrawAllParticles(&render->particleBatch, render->circlePoints, &state->particles, playerPos, playerScreenPos, alpha, view, &render->particleCull);
+    DrawAllOrbs(&render->orbBatch, render->circlePoints, &state->orbs, playerPos, playerScreenPos, alpha, view, &render->particleCull);
+
+    Rectangle playerRec = {playerScreenPos.x, playerScreenPos.y, playerSize, playerSize};
+    DrawRectanglePro(playerRec, playerOffset, state->playerRotation, BLACK);
+    
+
+    
+    {
+    PROFILE_SCOPE("DrawBullets");
+    for (int n = 0; n < state->bulletPool.activeCount; n++) {
+        
+        int i = state->bulletPool.activeSlots[n];
+        int bulletSize = state->guns[state->bullets[i].gunIndex].bulletSize + state->guns[state->playerBonusStatsIndex].bulletSize;
+        Vector2 bulletPos = LerpPos(state->bullets[i].prevPos, state->bullets[i].pos, alpha);
+        
+        if (!CullCircle(view, bulletPos, bulletSize, &render->bulletCull)) {
+            AddBulletToBatch(&render->bulletBatch, state->bullets, i, bulletPos, bulletSize, playerPos, playerScreenPos);
+        }
+    }
+    SubmitDrawBatch(&render->bulletBatch, RL_TRIANGLES);
+    }
+    
+    {
+    PROFILE_SCOPE("DrawZombies");
+    for (int n = 0; n < state->zombiePool.activeCount; n++) {
+        
+        int i = state->zombiePool.activeSlots[n];
+        Vector2 zombiePos = {LerpFloat(state->zombies.prevX[i], state->zombies.x[i], alpha), LerpFloat(state->zombies.prevY[i], state->zombies.y[i], alpha)};
+        
+        //Half the diagonal of the outline covers any rotation
+        float zombieRadius = (state->zombies.size[i]/2 + 4) * 1.4143f;
+        
+        if (!CullCircle(view, zombiePos, zombieRadius, &render->zombieCull)) {
+            AddZombieToBatch(&render->zombieBatch, &state->zombies, i, state->zombieTypes, zombiePos, playerPos, playerScreenPos);
+        }
+    }
+    SubmitDrawBatch(&render->zombieBatch, RL_QUADS);
+    }
+    
+    float rotation = 0;
+    for (int i = 0; i < 4; i++) {
+        int wallWidth = 1000;
+        
+        Rectangle rect = {GetPos(playerPos.x, playerScreenPos.x, state->mapWalls[i].x), GetPos(playerPos.y, playerScreenPos.y, state->mapWalls[i].y), mapHeight+wallWidth, wallWidth};
+        Vector2 offset = {0, 0};
+        DrawRectanglePro(rect, offset, rotation, GRAY);
+        
+        rotation -= 90;
+    }
+
+    DrawPlayerHealthBar(&render->hud.healthBar, state->playerHealth, playerScreenPos);
+    DrawPlayerExpBar(&render->hud.expBar, state->playerExp, state->neededPlayerExp, state->playerLevel);
+    
+    if (state->playerDead == 1) {
+        ShowDeathScreen();
+    }
+    
+    if (state->upgradeTime == 1) {
+        DrawPlayerUpgrades(render->hud.upgradeCards, &state->frameArena, state->upgradesPointer, state->upgradesCount);
+    }            
+    
+    if (render->showCullStats) {
+        DrawCullStats(render);
+    }
+    
+}
+
+SimInput ReadPlayerInput(GameState* state, Vector2 playerScreenPos, int* counter) {
+    
+    SimInput input;
+    
+    input.right = IsKeyDown(KEY_D);
+    input.left = IsKeyDown(KEY_A);
+    input.up = IsKeyDown(KEY_W);
+    input.down = IsKeyDown(KEY_S);
+    input.shoot = IsMouseButtonDown(MOUSE_BUTTON_LEFT) || IsKeyDown(KEY_SPACE);
+    input.aimRotation = atan2((playerScreenPos.y - GetMouseY()), (playerScreenPos.x - GetMouseX()))*(180/PI);
+    input.upgradePick = -1;
+    
+    if (state->upgradeTime == 1) {
+        
+        if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT) || (IsKeyReleased(KEY_SPACE) && *counter < 1)) {
+            
+            input.upgradePick = CheckUpgradeHitboxes(&state->frameArena, state->upgradesCount, GetMousePosition());
+            
+            if (input.upgradePick != -1) {
+                *counter = 0;
+            }
+            
+        } else {
+            
+            *counter += 1;
+            
+        }
+        
+    }
+    
+    return input;
+    
+}
+
+//Stand-in player for headless runs: always shooting at the closest zombie and taking the first upgrade
+SimInput GetAutopilotInput(GameState* state) {
+    
+    SimInput input = {false, false, false, false, true, state->playerRotation, -1};
+    
+    float closestDistanceSqr = -1;
+    Vector2 closestZombiePos = state->playerPos;
+    
+    for (int n = 0; n < state->zombiePool.activeCount; n++) {
+        
+        Vector2 zombiePos = GetZombiePos(&state->zombies, state->zombiePool.activeSlots[n]);
+        float distanceSqr = V2DistanceSqr(zombiePos, state->playerPos);
+        
+        if (closestDistanceSqr < 0 || distanceSqr < closestDistanceSqr) {
+            closestDistanceSqr = distanceSqr;
+            closestZombiePos = zombiePos;
+        }
+    }
+    
+    //The aim is an angle like the mouse gives, made once for the closest zombie
+    if (closestDistanceSqr >= 0) {
+        input.aimRotation = GetAngle(state->playerPos, closestZombiePos);
+    }
+    
+    if (state->upgradeTime == 1) {
+        input.upgradePick = 0;
+    }
+    
+    return input;
+    
+}
+
+const char inputLogMagic[4] = {'Z', 'S', 'R', 'P'};
+const int inputLogVersion = 2;
+const int maxInputRunLength = 65535;
+
+//Input flags
+const int inputUp = 1;
+const int inputDown = 2;
+const int inputLeft = 4;
+const int inputRight = 8;
+const int inputShoot = 16;
+const int inputHasPick = 32;
+
+//Numbers are stored little endian whatever the machine is
+void WriteLogNumber(FILE* file, unsigned int value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        fputc((value >> (8*i)) & 0xff, file);
+    }
+}
+
+bool ReadLogNumber(FILE* file, unsigned int* value, int bytes) {
+    
+    *value = 0;
+    
+    for (int i = 0; i < bytes; i++) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return(false);
+        }
+        *value |= (unsigned int)byte << (8*i);
+    }
+    
+    return(true);
+}
+
+bool SameInput(SimInput* a, SimInput* b) {
+    return(a->up == b->up && a->down == b->down && a->left == b->left && a->right == b->right && a->shoot == b->shoot && memcmp(&a->aimRotation, &b->aimRotation, sizeof(float)) == 0 && a->upgradePick == b->upgradePick);
+}
+
+bool StartInputRecording(InputLog* log, const char* path, unsigned int seed, int tickRate, const GameConfig* config) {
+    
+    log->file = fopen(path, "wb");
+    
+    if (log->file == NULL) {
+        printf("Could not write %s\n", path);
+        return(false);
+    }
+    
+    log->seed = seed;
+    log->tickRate = tickRate;
+    log->config = *config;
+    log->ticks = 0;
+    log->runLength = 0;
+    
+    fwrite(inputLogMagic, 1, sizeof(inputLogMagic), log->file);
+    WriteLogNumber(log->file, inputLogVersion, 2);
+    WriteLogNumber(log->file, seed, 4);
+    WriteLogNumber(log->file, tickRate, 2);
+    WriteLogNumber(log->file, config->particleCapacity, 4);
+    WriteLogNumber(log->file, config->zombieCapacity, 4);
+    WriteLogNumber(log->file, config->bulletCapacity, 4);
+    
+    return(true);
+}
+
+void WriteInputRun(InputLog* log) {
+    
+    SimInput* input = &log->runInput;
+    unsigned int flags = 0;
+    unsigned int aimBits;
+    memcpy(&aimBits, &input->aimRotation, sizeof(float));
+    
+    flags |= input->up ? inputUp : 0;
+    flags |= input->down ? inputDown : 0;
+    flags |= input->left ? inputLeft : 0;
+    flags |= input->right ? inputRight : 0;
+    flags |= input->shoot ? inputShoot : 0;
+    flags |= (input->upgradePick != -1) ? inputHasPick : 0;
+    
+    WriteLogNumber(log->file, log->runLength, 2);
+    WriteLogNumber(log->file, flags, 1);
+    WriteLogNumber(log->file, aimBits, 4);
+    
+    if (input->upgradePick != -1) {
+        WriteLogNumber(log->file, input->upgradePick, 1);
+    }
+    
+    log->runLength = 0;
+    
+}
+
+//Call with the input of every tick, in order
+void RecordInput(InputLog* log, SimInput* input) {
+    
+    if (log->runLength > 0 && (log->runLength == maxInputRunLength || !SameInput(&log->runInput, input))) {
+        WriteInputRun(log);
+    }
+    
+    log->runInput = *input;
+    log->runLength++;
+    log->ticks++;
+    
+}
+
+void FinishInputRecording(InputLog* log) {
+    
+    if (log->runLength > 0) {
+        WriteInputRun(log);
+    }
+    
+    printf("Recorded %ld ticks, %ld bytes\n", log->ticks, ftell(log->file));
+    fclose(log->file);
+    log->file = NULL;
+    
+}
+
+bool OpenInputReplay(InputLog* log, const char* path) {
+    
+    log->file = fopen(path, "rb");
+    
+    if (log->file == NULL) {
+        printf("Could not read %s\n", path);
+        return(false);
+    }
+    
+    char magic[4];
+    unsigned int version, seed, tickRate, particleCapacity;
+    
+    //Version 1 recordings were made when zombies and bullets had fixed 2048 and 1024 slot arrays
+    unsigned int zombieCapacity = 2048;
+    unsigned int bulletCapacity = 1024;
+    
+    if (fread(magic, 1, sizeof(magic), log->file) != sizeof(magic) || memcmp(magic, inputLogMagic, sizeof(magic)) != 0 || !ReadLogNumber(log->file, &version, 2) || version < 1 || version > inputLogVersion || !ReadLogNumber(log->file, &seed, 4) || !ReadLogNumber(log->file, &tickRate, 2) || !ReadLogNumber(log->file, &particleCapacity, 4) || tickRate == 0 || (version >= 2 && (!ReadLogNumber(log->file, &zombieCapacity, 4) || !ReadLogNumber(log->file, &bulletCapacity, 4)))) {
+        printf("%s is not a recording this version can play\n", path);
+        fclose(log->file);
+        log->file = NULL;
+        return(false);
+    }
+    
+    log->seed = seed;
+    log->tickRate = tickRate;
+    log->config.particleCapacity = particleCapacity;
+    log->config.zombieCapacity = zombieCapacity;
+    log->config.bulletCapacity = bulletCapacity;
+    log->ticks = 0;
+    log->runLength = 0;
+    
+    return(true);
+}
+
+//Gives the input of the next tick, false once the recording has run out
+bool ReadReplayInput(InputLog* log, SimInput* input) {
+    
+    if (log->file == NULL) {
+        return(false);
+    }
+    
+    if (log->runLength == 0) {
+        
+        unsigned int runLength, flags, aimBits, pick = 0;
+        
+        if (!ReadLogNumber(log->file, &runLength, 2) || !ReadLogNumber(log->file, &flags, 1) || !ReadLogNumber(log->file, &aimBits, 4) || ((flags & inputHasPick) && !ReadLogNumber(log->file, &pick, 1)) || runLength == 0) {
+            fclose(log->file);
+            log->file = NULL;
+            return(false);
+        }
+        
+        log->runInput.up = flags & inputUp;
+        log->runInput.down = flags & inputDown;
+        log->runInput.left = flags & inputLeft;
+        log->runInput.right = flags & inputRight;
+        log->runInput.shoot = flags & inputShoot;
+        memcpy(&log->runInput.aimRotation, &aimBits, sizeof(float));
+        log->runInput.upgradePick = (flags & inputHasPick) ? (int)pick : -1;
+        log->runLength = runLength;
+    }
+    
+    *input = log->runInput;
+    log->runLength--;
+    log->ticks++;
+    
+    return(true);
+}
+
+//FNV-1a over the player and every live zombie, two runs of the same session end on the same number
+unsigned int GetSessionChecksum(GameState* state) {
+    
+    unsigned int hash = 2166136261u;
+    float values[6] = {state->playerPos.x, state->playerPos.y, state->playerHealth, state->playerExp, state->wave, state->zombiePool.activeCount};
+    
+    for (int i = 0; i < 6; i++) {
+        unsigned int bits;
+        memcpy(&bits, &values[i], sizeof(float));
+        hash = (hash ^ bits) * 16777619u;
+    }
+    
+    for (int n = 0; n < state->zombiePool.activeCount; n++) {
+        int i = state->zombiePool.activeSlots[n];
+        unsigned int bits[2];
+        memcpy(&bits[0], &state->zombies.x[i], sizeof(float));
+        memcpy(&bits[1], &state->zombies.y[i], sizeof(float));
+        hash = (hash ^ bits[0]) * 16777619u;
+        hash = (hash ^ bits[1]) * 16777619u;
+    }
+    
+    return(hash);
+}
+
+//Plays a recording as fast as possible, the tick rate and capacities come from the file
+int RunReplayHeadless(const char* path, int workerCount) {
+    
+    InputLog log;
+    
+    if (!OpenInputReplay(&log, path)) {
+        return 1;
+    }
+    
+    GameConfig config = log.config;
+    
+    JobSystem jobs;
+    InitJobSystem(&jobs, workerCount);
+    
+    GameState state;
+    InitGameState(&state, &jobs, &config);
+    srand(log.seed);
+    
+    float frameTime = 1.0f/log.tickRate;
+    SimInput input;
+    
+    double start = GetMonotonicTime();
+    
+    while (ReadReplayInput(&log, &input)) {
+        SimulationStep(&state, &input, frameTime);
     }
     
-    free(upgradesRectangles);
+    double elapsed = GetMonotonicTime() - start;
     
+    printf("Replayed %ld ticks at %d Hz in %.3f s (%.0f ticks/sec), seed %u, wave %d, %d zombies alive, checksum %08x\n", log.ticks, log.tickRate, elapsed, log.ticks/elapsed, log.seed, state.wave, state.zombiePool.activeCount, GetSessionChecksum(&state));
+    
+    FreeGameState(&state);
+    FreeJobSystem(&jobs);
+    
+    return 0;
 }
 
-void DoUpgrade(int chosenUpgrade, int playerBonusStatsIndex, Gun* guns) {
+int RunHeadless(int ticks, int tickRate, int workerCount, const GameConfig* config, const char* recordPath) {
     
-    /*
-    int bulletCount;
-    int rpm;
-    double damage;
-    int penetration;
-    double speed;
-    int bulletSize;
-    double accuracy; 
-    */
+    JobSystem jobs;
+    InitJobSystem(&jobs, workerCount);
     
-    int bulletCountPlus = 1;
-    int rpmPlus = 60;
-    double damagePlus = 5;
-    int penetrationPlus = 1;
-    double speedPlus = 100;
-    int bulletSizePlus = 2;
-    double accuracyPlus = 4;
+    GameState state;
+    InitGameState(&state, &jobs, config);
     
-    if (chosenUpgrade == 0) {
-        guns[playerBonusStatsIndex].bulletCount += bulletCountPlus;
-    } else if (chosenUpgrade == 1) {
-        guns[playerBonusStatsIndex].rpm += rpmPlus;
-    } else if (chosenUpgrade == 2) {
-        guns[playerBonusStatsIndex].damage += damagePlus;
-    } else if (chosenUpgrade == 3) {
-        guns[playerBonusStatsIndex].penetration += penetrationPlus;
-    } else if (chosenUpgrade == 4) {
-        guns[playerBonusStatsIndex].speed += speedPlus;
-    } else if (chosenUpgrade == 5) {
-        guns[playerBonusStatsIndex].bulletSize += bulletSizePlus;
-    } else if (chosenUpgrade == 6) {
-        guns[playerBonusStatsIndex].accuracy += accuracyPlus;
-    }  
+    unsigned int seed = 1;
+    srand(seed);
     
-}
-
-bool CheckUpgradeHitboxes(int* chosenUpgrades, int upgradesCount, int playerBonusStatsIndex, Gun* guns) {
+    InputLog log;
+    bool recording = recordPath != NULL && StartInputRecording(&log, recordPath, seed, tickRate, config);
     
-    Rectangle *upgradesRectangles = malloc(upgradesCount * sizeof(Rectangle));
+    float frameTime = 1.0f/tickRate;
+    int restarts = 0;
+    long totalTicks = 0;
     
-    Vector2 mousePosition = GetMousePosition();
+    double start = GetMonotonicTime();
     
-    for (int i = 0; i < upgradesCount; i++) {
-       
-        upgradesRectangles[i] = GetUpgradeRectangle(i, upgradesCount);
+    for (int tick = 0; tick < ticks; tick++) {
         
-        if (CheckCollisionPointRec(mousePosition, upgradesRectangles[i])) {
-            
-            DoUpgrade(chosenUpgrades[i], playerBonusStatsIndex, guns);
-            free(chosenUpgrades);
-            return(true);
-            
+        SimInput input = GetAutopilotInput(&state);
+        SimulationStep(&state, &input, frameTime);
+        totalTicks++;
+        
+        if (recording) {
+            RecordInput(&log, &input);
+        }
+        
+        //A recording is one session, it ends where the autopilot dies
+        if (recording && state.playerDead == 1) {
+            printf("Died on wave %d after %ld ticks\n", state.wave, state.tick);
+            break;
+        }
+        
+        //Soak runs keep going after the autopilot dies
+        if (state.playerDead == 1) {
+            printf("Died on wave %d after %ld ticks\n", state.wave, state.tick);
+            FreeGameState(&state);
+            InitGameState(&state, &jobs, config);
+            restarts++;
         }
-     
     }
     
-    free(upgradesRectangles);
+    double elapsed = GetMonotonicTime() - start;
     
-    return(false);
+    printf("Headless: %ld ticks at %d Hz in %.3f s, %.0f ticks/sec (%.2f ms/tick), seed %u, restarts %d, wave %d, %d zombies alive, %d workers\n", totalTicks, tickRate, elapsed, totalTicks/elapsed, elapsed*1000/totalTicks, seed, restarts, state.wave, state.zombiePool.activeCount, jobs.workerCount);
     
-} 
-
-
-
+    if (recording) {
+        FinishInputRecording(&log);
+        printf("Checksum %08x\n", GetSessionChecksum(&state));
+    }
+    
+    FreeGameState(&state);
+    FreeJobSystem(&jobs);
+    
+    return 0;
+}
 
 
+//Scenario benchmark: a fixed load run for a set number of ticks with every phase timed
+typedef struct BenchScenario {
+    const char* name;
+    const char* description;
+    int wave;
+    int zombieCount;
+    float innerRadius;
+    float outerRadius;
+    int gun;
+} BenchScenario;
+
+const BenchScenario benchScenarios[] = {
+    {"waves", "normal game from wave 1 with the pistol, player cannot die", 1, 0, 0, 0, 1},
+    {"horde-minigun", "wave 50 with 2048 zombies around the player, minigun firing continuously", 50, 2048, 250, 1000, 5},
+    {"obliteration", "obliteration bursts of 360 bullets into a dense horde of 2048", 50, 2048, 150, 450, 6},
+    {"horde-20k", "wave 1000 with 20000 zombies spread over the map, minigun firing continuously", 1000, 20000, 250, 1400, 5}
+};
+const int benchScenarioCount = sizeof(benchScenarios) / sizeof(benchScenarios[0]);
+
+const char* simPhaseNames[simPhaseCount] = {"spawn", "zombie_move", "attack", "bullets", "particles", "draw"};
+
+typedef struct BenchStats {
+    double mean;
+    double p50;
+    double p99;
+    double max;
+} BenchStats;
+
+int CompareDoubles(const void* a, const void* b) {
+    double difference = *(const double*)a - *(const double*)b;
+    return (difference > 0) - (difference < 0);
+}
 
-int main(void)
-{   
-    //Creating map walls
-    struct Vector2 mapWalls[4];
+//Sorts samples in place
+BenchStats GetBenchStats(double* samples, int count) {
+    
+    BenchStats stats = {0, 0, 0, 0};
     
-    mapWalls[0].x = -mapWidth/2+playerSize/2;
-    mapWalls[0].y = mapHeight/2+playerSize/2;
+    if (count == 0) {
+        return(stats);
+    }
+    
+    qsort(samples, count, sizeof(double), CompareDoubles);
     
-    mapWalls[1].x = mapWidth/2+playerSize/2;
-    mapWalls[1].y = mapHeight/2+playerSize/2;
+    for (int i = 0; i < count; i++) {
+        stats.mean += samples[i];
+    }
     
-    mapWalls[2].x = mapWidth/2+playerSize/2;
-    mapWalls[2].y = -mapHeight/2+playerSize/2;
+    stats.mean /= count;
+    stats.p50 = samples[(count - 1) / 2];
+    stats.p99 = samples[(int)((count - 1) * 0.99)];
+    stats.max = samples[count - 1];
     
-    mapWalls[3].x = -mapWidth/2+playerSize/2;
-    mapWalls[3].y = -mapHeight/2+playerSize/2;
+    return(stats);
+}
 
-    //Creating zombie types
-    ZombieType zombieTypes[4] = {
-        //Normal
-        {0, 100, 3, zDefSize, zDefMoveSpeed, zDefDamage, zDefHealth, zDefAttackDelay, GREEN},
+void SetUpBenchScenario(GameState* state, const BenchScenario* scenario) {
+    
+    state->wave = scenario->wave;
+    state->currentGun = scenario->gun;
+    
+    //A horde in a ring around the player, types rolled like the wave would
+    for (int n = 0; n < scenario->zombieCount; n++) {
         
-        //Strong
-        {2, 10, 6, zDefSize*1.5, zDefMoveSpeed*0.9, zDefDamage*2, zDefHealth*4, zDefAttackDelay*1.5, RED}, 
+        int i = AllocateZombie(&state->zombies, &state->zombiePool);
         
-        //Fast
-        {4, 10, 3, zDefSize*0.8, zDefMoveSpeed*2, zDefDamage, zDefHealth*0.6, zDefAttackDelay*0.7, BLUE},
+        if (i == -1) {
+            break;
+        }
         
-        //Giant
-        {6, 2, 20, zDefSize*3.5, zDefMoveSpeed*0.7, zDefDamage*3.5, zDefHealth*10, zDefAttackDelay*5, PURPLE}
+        int type = ChooseZombieType(state->zombieTypes, state->wave);
+        float angle = GenerateRandInt(3600) / 10.0f;
+        float distance = scenario->innerRadius + GenerateRandInt((int)(scenario->outerRadius - scenario->innerRadius));
         
-    };
-    int wave = 1;
+        state->zombies.type[i] = type;
+        state->zombies.health[i] = state->zombieTypes[type].health;
+        state->zombies.speed[i] = state->zombieTypes[type].speed;
+        state->zombies.size[i] = state->zombieTypes[type].size;
+        state->zombies.x[i] = CalcCos(angle, distance);
+        state->zombies.y[i] = CalcSin(angle, distance);
+        state->zombies.prevX[i] = state->zombies.x[i];
+        state->zombies.prevY[i] = state->zombies.y[i];
+        state->zombies.xChange[i] = 0.0f;
+        state->zombies.yChange[i] = 0.0f;
+        state->zombies.xSeparation[i] = 0.0f;
+        state->zombies.ySeparation[i] = 0.0f;
+        state->zombies.lastAttackTime[i] = 0.0;
+    }
+    
+}
+
+void WriteBenchStatsJson(FILE* file, const char* name, BenchStats stats, bool last) {
+    fprintf(file, "    \"%s\": {\"mean_ms\": %.6f, \"p50_ms\": %.6f, \"p99_ms\": %.6f, \"max_ms\": %.6f}%s\n", name, stats.mean*1000, stats.p50*1000, stats.p99*1000, stats.max*1000, last ? "" : ",");
+}
+
+int RunBenchmark(const char* scenarioName, int ticks, int tickRate, int workerCount, const GameConfig* config, const char* outPath, bool draw) {
+    
+    const BenchScenario* scenario = NULL;
     
-    Vector2 defaultZombiePos = {mapWidth, mapHeight};
-    Vector2 defaultBulletPos = {mapWidth, mapHeight};
+    for (int i = 0; i < benchScenarioCount; i++) {
+        if (strcmp(benchScenarios[i].name, scenarioName) == 0) {
+            scenario = &benchScenarios[i];
+        }
+    }
     
-    Zombie currentZombies[maxZombieCount];
-    for (int i = 0; i<maxZombieCount; i++) {
-        currentZombies[i].pos = defaultZombiePos;
+    if (scenario == NULL) {
+        printf("Unknown scenario \"%s\", pick one of:\n", scenarioName);
+        for (int i = 0; i < benchScenarioCount; i++) {
+            printf("  %-16s %s\n", benchScenarios[i].name, benchScenarios[i].description);
+        }
+        return 1;
     }
     
-    for (int i = 0; i<maxZombieCount; i++) {
-        currentZombies[i].pos = defaultZombiePos;
+    JobSystem jobs;
+    InitJobSystem(&jobs, workerCount);
+    
+    GameState state;
+    InitGameState(&state, &jobs, config);
+    srand(1);
+    SetUpBenchScenario(&state, scenario);
+    
+    RenderState render;
+    Vector2 playerScreenPos = {(screenWidth)/2, (screenHeight)/2};
+    
+    //Drawing goes to a hidden window without a frame cap
+    if (draw) {
+        SetConfigFlags(FLAG_WINDOW_HIDDEN);
+        InitWindow(screenWidth, screenHeight, "benchmark");
+        InitRenderState(&render, &state);
     }
     
-    Bullet currentBullets[maxBulletCount];
-    int collisionArrayLength = sizeof(currentBullets[0].zHitIndexes) / sizeof(currentBullets[0].zHitIndexes[0]);
-    for (int i = 0; i<maxBulletCount; i++) {
-        currentBullets[i].pos = defaultBulletPos;
+    float frameTime = 1.0f/tickRate;
+    double* phaseSamples = malloc((size_t)ticks * (simPhaseCount + 1) * sizeof(double));
+    double* tickSamples = phaseSamples + (size_t)ticks * simPhaseCount;
+    
+    for (int tick = 0; tick < ticks; tick++) {
         
-        for (int j = 0; j<collisionArrayLength; j++) {
-            currentBullets[i].zHitIndexes[j] = -1;
+        //The load should stay the same, so no dying and no upgrade screens
+        state.playerHealth = playerMaxHealth;
+        state.playerExp = 0;
+        
+        SimInput input = GetAutopilotInput(&state);
+        
+        double start = GetMonotonicTime();
+        SimulationStep(&state, &input, frameTime);
+        
+        if (draw) {
+            double drawStart = GetMonotonicTime();
+            ResetLinearArena(&state.frameArena);
+            BeginDrawing();
+            DrawGame(&state, &render, playerScreenPos, 1.0f);
+            EndDrawing();
+            state.phaseTime[phaseDraw] = GetMonotonicTime() - drawStart;
         }
         
+        tickSamples[tick] = GetMonotonicTime() - start;
+        
+        for (int phase = 0; phase < simPhaseCount; phase++) {
+            phaseSamples[phase * ticks + tick] = state.phaseTime[phase];
+        }
     }
     
+    BenchStats phaseStats[simPhaseCount];
+    for (int phase = 0; phase < simPhaseCount; phase++) {
+        phaseStats[phase] = GetBenchStats(phaseSamples + phase * ticks, ticks);
+    }
+    BenchStats tickStats = GetBenchStats(tickSamples, ticks);
     
-    //Creating gun types
-    Gun guns[7] = {
-        /*
-        int bulletCount;
-        int rpm;
-        double damage;
-        int penetration;
-        double speed;
-        int bulletSize;
-        double accuracy; 
-        */
-        
-        //PlayerBonusStats
-        {0, 0, 0, 0, 0, 0, 0},
+    printf("Scenario %s: %s\n", scenario->name, scenario->description);
+    printf("%d ticks at %d Hz, %d workers, draw %s, ended on wave %d with %d zombies, %d bullets, %d particles, %d orbs\n", ticks, tickRate, jobs.workerCount, draw ? "on" : "off", state.wave, state.zombiePool.activeCount, state.bulletPool.activeCount, state.particles.count, state.orbs.count);
+    printf("%-12s %10s %10s %10s %10s\n", "phase (ms)", "mean", "p50", "p99", "max");
+    for (int phase = 0; phase < simPhaseCount; phase++) {
+        printf("%-12s %10.4f %10.4f %10.4f %10.4f\n", simPhaseNames[phase], phaseStats[phase].mean*1000, phaseStats[phase].p50*1000, phaseStats[phase].p99*1000, phaseStats[phase].max*1000);
+    }
+    printf("%-12s %10.4f %10.4f %10.4f %10.4f\n", "tick", tickStats.mean*1000, tickStats.p50*1000, tickStats.p99*1000, tickStats.max*1000);
+    
+    if (outPath != NULL) {
         
-        //Pistol        
-        {1, 200, 20.0, 1, 800.0, 10, 20},
-        //shotgun
-        {15, 200, 20, 1, 800.0, 6, 4},
-        //shotgun 2
-        {45, 500, 2, 1, 800.0, 8, 3.5},
-        //sniper
-        {1, 80, 100, 10, 1500.0, 15, 100},
-        //minigun
-        {1, 2500, 12, 1, 800.0, 8, 10},
-        //obliteration
-        {360, 100, 100, 2, 100, 100, 0.55}
+        FILE* file = fopen(outPath, "w");
         
-    };
+        if (file == NULL) {
+            printf("Could not write %s\n", outPath);
+        } else {
+            fprintf(file, "{\n");
+            fprintf(file, "  \"scenario\": \"%s\",\n", scenario->name);
+            fprintf(file, "  \"description\": \"%s\",\n", scenario->description);
+            fprintf(file, "  \"ticks\": %d,\n  \"tick_rate\": %d,\n  \"workers\": %d,\n  \"draw\": %s,\n", ticks, tickRate, jobs.workerCount, draw ? "true" : "false");
+            fprintf(file, "  \"end_state\": {\"wave\": %d, \"zombies\": %d, \"bullets\": %d, \"particles\": %d, \"orbs\": %d},\n", state.wave, state.zombiePool.activeCount, state.bulletPool.activeCount, state.particles.count, state.orbs.count);
+            fprintf(file, "  \"phases\": {\n");
+            for (int phase = 0; phase < simPhaseCount; phase++) {
+                WriteBenchStatsJson(file, simPhaseNames[phase], phaseStats[phase], false);
+            }
+            WriteBenchStatsJson(file, "tick", tickStats, true);
+            fprintf(file, "  }\n}\n");
+            fclose(file);
+            printf("Wrote %s\n", outPath);
+        }
+    }
+    
+    if (draw) {
+        FreeRenderState(&render);
+        CloseWindow();
+    }
+    
+    free(phaseSamples);
+    FreeGameState(&state);
+    FreeJobSystem(&jobs);
+    
+    return 0;
+}
+
+
+bool HasArg(int argc, char* argv[], const char* name) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Number following the flag, or defaultValue if the flag is missing or has no number after it
+int GetArgInt(int argc, char* argv[], const char* name, int defaultValue) {
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], name) == 0 && atoi(argv[i + 1]) > 0) {
+            return atoi(argv[i + 1]);
+        }
+    }
+    return defaultValue;
+}
+
+const char* GetArgString(int argc, char* argv[], const char* name, const char* defaultValue) {
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return argv[i + 1];
+        }
+    }
+    return defaultValue;
+}
+
+double GetArgDouble(int argc, char* argv[], const char* name, double defaultValue) {
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], name) == 0 && atof(argv[i + 1]) > 0) {
+            return atof(argv[i + 1]);
+        }
+    }
+    return defaultValue;
+}
 
-    int gunsRollTickets[7] = {1, 3, 6, 2, 3, 0, 6};
+int main(int argc, char* argv[])
+{   
+    int tickRate = GetArgInt(argc, argv, "--tick-rate", defaultTickRate);
+    double tickTime = 1.0/tickRate;
+    int workerCount = GetArgInt(argc, argv, "--threads", GetProcessorCount());
+    
+#if defined(ENABLE_PROFILER)
+    if (HasArg(argc, argv, "--trace")) {
+        StartProfilerTrace(GetArgString(argc, argv, "--trace", "trace.json"));
+    }
+#else
+    if (HasArg(argc, argv, "--trace")) {
+        printf("--trace needs a build with -DENABLE_PROFILER\n");
+    }
+#endif
     
+    GameConfig config;
+    config.particleCapacity = GetArgInt(argc, argv, "--particles", defaultParticleCapacity);
+    config.zombieCapacity = GetArgInt(argc, argv, "--max-zombies", defaultMaxZombieCount);
+    config.bulletCapacity = GetArgInt(argc, argv, "--max-bullets", defaultMaxBulletCount);
     
-    int currentGun = 1;
-    int playerBonusStatsIndex = 0;
+    const char* recordPath = GetArgString(argc, argv, "--record", NULL);
+    const char* replayPath = GetArgString(argc, argv, "--replay", NULL);
     
-    MapDetail mapDetails[environmentDetailLimit];
-    int detailRandomizer = GenerateRandInt(1000);
-    for (int i = 0; i < environmentDetailLimit; i++){
-        GenerateDetail(mapDetails, i);
+    //Benchmark and headless modes run without a window
+    if (HasArg(argc, argv, "--bench-move")) {
+        return BenchmarkZombieMovement(GetArgInt(argc, argv, "--bench-move", 200), workerCount);
     }
     
-    Particle particles[particleLimit];
-    for (int i = 0; i < particleLimit; i++){
-        particles[i].deathTime = 0; 
-        particles[i].speed = 0; 
+    if (HasArg(argc, argv, "--bench-math")) {
+        return BenchmarkVectorMath(GetArgInt(argc, argv, "--bench-math", 1000));
     }
     
-    double lastZombieSpawnTime = 0.0;
-    double oldLastZombieSpawnTime = 0.0;
+    if (HasArg(argc, argv, "--bench")) {
+        return RunBenchmark(GetArgString(argc, argv, "--bench", ""), GetArgInt(argc, argv, "--ticks", 1000), tickRate, workerCount, &config, GetArgString(argc, argv, "--out", NULL), HasArg(argc, argv, "--draw"));
+    }
     
-    Vector2 playerOffset = {playerSize/2, playerSize/2};
-    float playerRotation = 0.0f;
+    if (replayPath != NULL && HasArg(argc, argv, "--headless")) {
+        return RunReplayHeadless(replayPath, workerCount);
+    }
     
-    Vector2 playerPos = {0, 0};
-    Vector2 playerScreenPos = {(screenWidth)/2, (screenHeight)/2};
+    if (HasArg(argc, argv, "--headless")) {
+        return RunHeadless(GetArgInt(argc, argv, "--headless", 10000), tickRate, workerCount, &config, recordPath);
+    }
     
-    double currentMoveSpeed = moveSpeed;
+    //A replay brings its own tick rate and sizes
+    InputLog replay;
+    bool replaying = replayPath != NULL && OpenInputReplay(&replay, replayPath);
     
-    int playerLevel = 1;
-    double playerExp = 0;
-    double* playerExpPointer = &playerExp;
-    double expPerLevel = 35;
-    double neededPlayerExp =  playerLevel * expPerLevel;
+    if (replaying) {
+        tickRate = replay.tickRate;
+        tickTime = 1.0/tickRate;
+        config = replay.config;
+    }
     
-    int counter = 0;
+    JobSystem jobs;
+    InitJobSystem(&jobs, workerCount);
     
-    int playerDead = 0;
-    int upgradeTime = 0; 
-    int upgradesCount = 3;
-    int* upgradesPointer;
+    GameState state;
+    InitGameState(&state, &jobs, &config);
     
-    int spawnedZombieCount = 0;
-
-    double lastShotTime = GetCurrentTime();
+    RenderState render;
+    SetGameClockScale(&state.clock, GetArgDouble(argc, argv, "--time-scale", 1.0));
     
-    double playerHealth = playerMaxHealth;
-    double* playerHealthPointer = &playerHealth;
+    Vector2 playerScreenPos = {(screenWidth)/2, (screenHeight)/2};
+    
+    int counter = 0;
+    int pendingUpgradePick = -1;
+    double accumulator = 0;
   
 
     InitWindow(screenWidth, screenHeight, "raylib test");
     SetTargetFPS(fps);
+    InitRenderState(&render, &state);
+    
+    unsigned int seed = replaying ? replay.seed : ((unsigned int)(GetMonotonicTime() * 1000000) ^ getpid());
+    srand(seed); 
     
-    srand((unsigned int)(clock()) ^ getpid()); 
+    InputLog recording;
+    bool recordingInput = !replaying && recordPath != NULL && StartInputRecording(&recording, recordPath, seed, tickRate, &config);
+    
+    //Time spent opening the window is not game time
+    SampleGameClock(&state.clock, maxFrameTime);
     
     while (!WindowShouldClose())    // Detect window close button or ESC key
     {
         
-        //if player is alive
-        if (playerDead == 0 && upgradeTime == 0) {
-            
-            //Movement Calculation:
-            currentMoveSpeed = moveSpeed*GetFrameTime();
-           
-            double yVel = 0;
-            double xVel = 0;
-            
-            if (IsKeyDown(KEY_D)) {
-                xVel += currentMoveSpeed; 
-            }
-            if (IsKeyDown(KEY_A)) {
-                xVel -= currentMoveSpeed;
-            }
-            if (IsKeyDown(KEY_W)) {
-                yVel -= currentMoveSpeed;
-            }
-            if (IsKeyDown(KEY_S)) {
-                yVel += currentMoveSpeed; 
-            }      
-            if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) || IsKeyDown(KEY_SPACE)) {
-                lastShotTime = Shoot(guns, currentGun, lastShotTime, currentBullets, playerPos, defaultBulletPos, playerRotation, playerBonusStatsIndex);
-            }
-            
-            if (xVel != 0 && yVel != 0) {
-                
-                double k = currentMoveSpeed/(sqrt(pow(yVel, 2) + pow(xVel, 2)));
-                
-                playerPos.x = playerPos.x + xVel*k;
-                playerPos.y = playerPos.y + yVel*k;
-                
-            } else {
-                playerPos.x = playerPos.x + xVel;
-                playerPos.y = playerPos.y + yVel;
-            }
-            
-            if (playerPos.x > mapWidth/2) {
-                playerPos.x = mapWidth/2;
-            } else if (playerPos.x < -mapWidth/2+playerSize){
-                playerPos.x = -mapWidth/2+playerSize;
-            }
-            
-            if (playerPos.y > mapHeight/2) {
-                playerPos.y = mapHeight/2;
-            } else if (playerPos.y < -mapHeight/2+playerSize){
-                playerPos.y = -mapHeight/2+playerSize;
-            }
-            
-            //Player Rotation Calculation:
-            playerRotation = atan2((playerScreenPos.y - GetMouseY()), (playerScreenPos.x - GetMouseX()))*(180/PI);
-            
-            //Heal player
-            playerHealth += playerHealingPerSec * GetFrameTime();
-            if (playerHealth > playerMaxHealth) {
-                
-                playerHealth = playerMaxHealth;
-                
-            } else if (playerHealth <= 0) {
-                
-                playerDead = 1;
-                
-            }
-            
-            //Check lvlUp
-            if (playerExp > neededPlayerExp) {
-                
-                playerExp -= neededPlayerExp;
-                playerLevel += 1;
-                neededPlayerExp =  playerLevel * expPerLevel;
-                
-                upgradeTime = 1;
-                upgradesPointer = GetPlayerUpgrades(upgradesCount, gunsRollTickets);
-            }
-            
-            
-            
-            //Zomibe alive check
-            int targetZombieCount = difficulty*wave;
-
-            if (targetZombieCount != spawnedZombieCount) {
-                oldLastZombieSpawnTime = lastZombieSpawnTime;
-                
-                lastZombieSpawnTime = CreateZombie(currentZombies, zombieTypes, wave, lastZombieSpawnTime, defaultZombiePos);
-                
-                if (oldLastZombieSpawnTime != lastZombieSpawnTime) {
-                    spawnedZombieCount++;
-                }
-            }
-            
-            int aliveZombies = 0;
-            for (int i = 0; i<maxZombieCount; i++) {
-                if (!Vector2Compare(currentZombies[i].pos, defaultZombiePos)) {
-                    MoveZombie(currentZombies, i, playerPos, zombieTypes, defaultZombiePos);
-                    ZombieAttackCheck(currentZombies, i, playerPos, zombieTypes, playerHealthPointer);
-                    aliveZombies ++;
-                }
-            }
+        PROFILE_SCOPE("Frame");
+        
+        //Nothing from the frame arena outlives the frame it was made in
+        ResetLinearArena(&state.frameArena);
+        
+        SimInput input = ReadPlayerInput(&state, playerScreenPos, &counter);
+        
+        if (IsKeyPressed(KEY_F2)) {
+            render.showCullStats = !render.showCullStats;
+        }
+        
+        if (IsKeyPressed(KEY_F3)) {
+            PROFILER_TOGGLE_OVERLAY();
+        }
+        
+        //A click can land on a frame without a tick, keep it until one runs
+        if (input.upgradePick != -1) {
+            pendingUpgradePick = input.upgradePick;
+        }
+        
+        accumulator += SampleGameClock(&state.clock, maxFrameTime);
+        
+        while (accumulator >= tickTime) {
             
-            if (aliveZombies == 0 && targetZombieCount == spawnedZombieCount) {
-                wave++;
-                spawnedZombieCount = 0;
-            } 
+            PROFILE_SCOPE("Tick");
+            input.upgradePick = pendingUpgradePick;
+            pendingUpgradePick = -1;
             
-            MoveAllParticles(particles, playerPos, playerExpPointer);
+            SimInput tickInput = input;
             
-            for (int i = 0; i<maxBulletCount; i++) {
-                if (!Vector2Compare(currentBullets[i].pos, defaultBulletPos)) {
-                    MoveBullet(currentBullets, i, defaultBulletPos, playerPos);
-                    CheckHitsAll(currentBullets, i, currentZombies, zombieTypes, defaultZombiePos, defaultBulletPos, particles);
-                }
+            //The recording drives the game until it runs out, then the keyboard takes over
+            if (replaying && !ReadReplayInput(&replay, &tickInput)) {
+                replaying = false;
+                tickInput = input;
+                printf("Replay finished after %ld ticks, checksum %08x\n", replay.ticks, GetSessionChecksum(&state));
             }
             
-        } else if (upgradeTime == 1) {
-            
-            if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT) || IsKeyReleased(KEY_SPACE) && counter < 1) {
-                if (CheckUpgradeHitboxes(upgradesPointer, upgradesCount, playerBonusStatsIndex, guns)) {
-                    
-                    upgradeTime = 0;
-                    counter = 0;
-                    
-                }
-                
-            } else {
-                
-                counter += 1;
-                
+            if (recordingInput) {
+                RecordInput(&recording, &tickInput);
             }
             
+            SimulationStep(&state, &tickInput, tickTime);
+            accumulator -= tickTime;
         }
         
         
@@ -1326,64 +5194,32 @@ int main(void)
         //---------------------------------------------------------------------------------
         BeginDrawing();
 
-            ClearBackground(LIME);
-            
-            DrawAllDetail (mapDetails, detailRandomizer, playerPos, playerScreenPos);
-            
-            DrawAllParticles(particles, playerPos, playerScreenPos);
-
-            Rectangle playerRec = {playerScreenPos.x, playerScreenPos.y, playerSize, playerSize};
-            DrawRectanglePro(playerRec, playerOffset, playerRotation, BLACK);
-            
-
-            
-            for (int i = 0; i<maxBulletCount; i++) {
-                if (!Vector2Compare(currentBullets[i].pos, defaultBulletPos)) {
-                    DrawBullet(guns, currentBullets, i, playerPos, playerScreenPos, playerBonusStatsIndex);
-                }
-            }
-            
-            for (int i = 0; i<maxZombieCount; i++) {
-                if (!Vector2Compare(currentZombies[i].pos, defaultZombiePos)) {
-                    DrawZombie(currentZombies, i, zombieTypes, playerPos, playerScreenPos);
-                }
-            }
-            
-            float rotation = 0;
-            for (int i = 0; i < 4; i++) {
-                int wallWidth = 1000;
-                
-                Rectangle rect = {GetPos(playerPos.x, playerScreenPos.x, mapWalls[i].x), GetPos(playerPos.y, playerScreenPos.y, mapWalls[i].y), mapHeight+wallWidth, wallWidth};
-                Vector2 offset = {0, 0};
-                DrawRectanglePro(rect, offset, rotation, GRAY);
-                
-                rotation -= 90;
-            }
-        
-            DrawPlayerHealthBar(playerHealth, playerScreenPos);
-            DrawPlayerExpBar(playerExp, neededPlayerExp, playerLevel);
-            
-            if (playerDead == 1) {
-                ShowDeathScreen();
-            }
-            
-            if (upgradeTime == 1) {
-                DrawPlayerUpgrades(upgradesPointer, upgradesCount);
-            }            
+            DrawGame(&state, &render, playerScreenPos, accumulator / tickTime);
+            PROFILER_DRAW_OVERLAY();
             
-        EndDrawing();
+        {
+            //Mostly waiting for vsync and the frame limit
+            PROFILE_SCOPE("EndDrawing");
+            EndDrawing();
+        }
         //----------------------------------------------------------------------------------
+        
+        PROFILER_END_FRAME();
     }
 
     // De-Initialization
     //-------------------------------------------------------------------------------------- 
+    FreeRenderState(&render);
     CloseWindow();        // Close window and OpenGL context
     //--------------------------------------------------------------------------------------
+    
+    if (recordingInput) {
+        FinishInputRecording(&recording);
+        printf("Checksum %08x\n", GetSessionChecksum(&state));
+    }
+    
+    FreeGameState(&state);
+    FreeJobSystem(&jobs);
 
     return 0;
 }
-
-
-
-
-